@@ -7,10 +7,38 @@
 
 #include <string.h>
 #include <stddef.h>
+#include <stdint.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 static const unsigned char base64_table[65] =
 	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
+/* value of each character, 0xff for characters outside of the alphabet (including '=') */
+static const unsigned char base64_dtable[256] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+	0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+	0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
 void base64_encode(const unsigned char *src, size_t len, unsigned char *out)
 {
 	unsigned char *pos;
@@ -46,18 +74,13 @@ void base64_encode(const unsigned char *src, size_t len, unsigned char *out)
 
 void base64_decode(const unsigned char *src, size_t len, unsigned char *out)
 {
-	unsigned char dtable[256], *pos, block[4], tmp;
+	unsigned char *pos, block[4], tmp;
 	size_t i, count;
 	int pad = 0;
 
-	memset(dtable, 0x80, 256);
-	for (i = 0; i < sizeof(base64_table) - 1; i++)
-		dtable[base64_table[i]] = (unsigned char) i;
-	dtable['='] = 0;
-
 	count = 0;
 	for (i = 0; i < len; i++) {
-		if (dtable[src[i]] != 0x80)
+		if (base64_dtable[src[i]] != 0xff || src[i] == '=')
 			count++;
 	}
 
@@ -69,12 +92,14 @@ void base64_decode(const unsigned char *src, size_t len, unsigned char *out)
 
 	count = 0;
 	for (i = 0; i < len; i++) {
-		tmp = dtable[src[i]];
-		if (tmp == 0x80)
-			continue;
-
-		if (src[i] == '=')
+		if (src[i] == '=') {
+			tmp = 0;
 			pad++;
+		} else {
+			tmp = base64_dtable[src[i]];
+			if (tmp == 0xff)
+				continue;
+		}
 		block[count] = tmp;
 		count++;
 		if (count == 4) {
@@ -95,3 +120,254 @@ void base64_decode(const unsigned char *src, size_t len, unsigned char *out)
 		}
 	}
 }
+
+/*
+ * Bulk conversion of 32-byte keys to and from their 44-character encoding.
+ * The first 24 bytes (32 characters) of each key are converted with SSSE3,
+ * AVX2 or NEON instructions when the compiler targets them, the rest with
+ * the tables above.
+ */
+
+#if defined(__AVX2__) || defined(__SSSE3__)
+
+#define b64_simd_bytes 24
+
+/* 12 bytes to 16 characters per 128-bit lane, with _P_ intrinsics on W-bit vectors
+ * (see W. Mula, D. Lemire, "Faster Base64 Encoding and Decoding using AVX2
+ * Instructions") */
+#define B64_ENC_LANES(P, W, in, res) do { \
+	__m##W##i idx; \
+	in = _##P##_shuffle_epi8(in, _##P##_set_epi8(B64_ENC_SHUF)); \
+	idx = _##P##_or_si##W( \
+		_##P##_mulhi_epu16(_##P##_and_si##W(in, _##P##_set1_epi32(0x0fc0fc00)), _##P##_set1_epi32(0x04000040)), \
+		_##P##_mullo_epi16(_##P##_and_si##W(in, _##P##_set1_epi32(0x003f03f0)), _##P##_set1_epi32(0x01000010))); \
+	res = _##P##_subs_epu8(idx, _##P##_set1_epi8(51)); \
+	res = _##P##_or_si##W(res, _##P##_and_si##W(_##P##_cmpgt_epi8(_##P##_set1_epi8(26), idx), _##P##_set1_epi8(13))); \
+	res = _##P##_add_epi8(_##P##_shuffle_epi8(_##P##_setr_epi8(B64_ENC_SHIFT), res), idx); \
+} while (0)
+
+/* 16 characters to 12 bytes per 128-bit lane, bad is nonzero for invalid characters */
+#define B64_DEC_LANES(P, W, str, res, bad) do { \
+	__m##W##i hi_nib, lo, hi; \
+	hi_nib = _##P##_and_si##W(_##P##_srli_epi32(str, 4), _##P##_set1_epi8(0x2f)); \
+	lo = _##P##_shuffle_epi8(_##P##_setr_epi8(B64_DEC_LO), _##P##_and_si##W(str, _##P##_set1_epi8(0x2f))); \
+	hi = _##P##_shuffle_epi8(_##P##_setr_epi8(B64_DEC_HI), hi_nib); \
+	bad = ~_##P##_movemask_epi8(_##P##_cmpeq_epi8(_##P##_and_si##W(lo, hi), _##P##_setzero_si##W())); \
+	str = _##P##_add_epi8(str, _##P##_shuffle_epi8(_##P##_setr_epi8(B64_DEC_ROLL), \
+		_##P##_add_epi8(_##P##_cmpeq_epi8(str, _##P##_set1_epi8(0x2f)), hi_nib))); \
+	res = _##P##_maddubs_epi16(str, _##P##_set1_epi32(0x01400140)); \
+	res = _##P##_madd_epi16(res, _##P##_set1_epi32(0x00011000)); \
+	res = _##P##_shuffle_epi8(res, _##P##_setr_epi8(B64_DEC_SHUF)); \
+} while (0)
+
+#define B64_ENC_SHUF16 10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1
+#define B64_ENC_SHIFT16 'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, \
+	'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0
+#define B64_DEC_LO16 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, \
+	0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a
+#define B64_DEC_HI16 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, \
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+#define B64_DEC_ROLL16 0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0
+#define B64_DEC_SHUF16 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1
+
+#if defined(__AVX2__)
+
+#define B64_ENC_SHUF B64_ENC_SHUF16, B64_ENC_SHUF16
+#define B64_ENC_SHIFT B64_ENC_SHIFT16, B64_ENC_SHIFT16
+#define B64_DEC_LO B64_DEC_LO16, B64_DEC_LO16
+#define B64_DEC_HI B64_DEC_HI16, B64_DEC_HI16
+#define B64_DEC_ROLL B64_DEC_ROLL16, B64_DEC_ROLL16
+#define B64_DEC_SHUF B64_DEC_SHUF16, B64_DEC_SHUF16
+
+static inline void b64_simd_encode(const unsigned char *src, unsigned char *out)
+{
+	__m256i in, res;
+
+	in = _mm256_inserti128_si256(_mm256_castsi128_si256(
+		_mm_loadu_si128((const __m128i *) src)),
+		_mm_loadu_si128((const __m128i *) (src + 12)), 1);
+	B64_ENC_LANES(mm256, 256, in, res);
+	_mm256_storeu_si256((__m256i *) out, res);
+}
+
+static inline int b64_simd_decode(const unsigned char *src, unsigned char *out)
+{
+	__m256i str, res;
+	int bad;
+
+	str = _mm256_loadu_si256((const __m256i *) src);
+	B64_DEC_LANES(mm256, 256, str, res, bad);
+	_mm_storeu_si128((__m128i *) out, _mm256_castsi256_si128(res));
+	_mm_storeu_si128((__m128i *) (out + 12), _mm256_extracti128_si256(res, 1));
+	return bad;
+}
+
+#else
+
+#define B64_ENC_SHUF B64_ENC_SHUF16
+#define B64_ENC_SHIFT B64_ENC_SHIFT16
+#define B64_DEC_LO B64_DEC_LO16
+#define B64_DEC_HI B64_DEC_HI16
+#define B64_DEC_ROLL B64_DEC_ROLL16
+#define B64_DEC_SHUF B64_DEC_SHUF16
+
+static inline void b64_simd_encode(const unsigned char *src, unsigned char *out)
+{
+	__m128i in, res;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		in = _mm_loadu_si128((const __m128i *) (src + 12 * i));
+		B64_ENC_LANES(mm, 128, in, res);
+		_mm_storeu_si128((__m128i *) (out + 16 * i), res);
+	}
+}
+
+static inline int b64_simd_decode(const unsigned char *src, unsigned char *out)
+{
+	__m128i str, res;
+	int i, bad, any = 0;
+
+	for (i = 0; i < 2; i++) {
+		str = _mm_loadu_si128((const __m128i *) (src + 16 * i));
+		B64_DEC_LANES(mm, 128, str, res, bad);
+		_mm_storeu_si128((__m128i *) (out + 12 * i), res);
+		any |= bad & 0xffff;
+	}
+	return any;
+}
+
+#endif
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+#define b64_simd_bytes 24
+
+static inline void b64_simd_encode(const unsigned char *src, unsigned char *out)
+{
+	static const uint8_t shuf[16] = { 2, 1, 0, 0xff, 5, 4, 3, 0xff, 8, 7, 6, 0xff, 11, 10, 9, 0xff };
+	uint8x16x4_t tbl = { { vld1q_u8(base64_table), vld1q_u8(base64_table + 16),
+		vld1q_u8(base64_table + 32), vld1q_u8(base64_table + 48) } };
+	uint32x4_t m = vdupq_n_u32(0x3f), v, idx;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		/* each 32-bit lane holds 3 input bytes, big-endian */
+		v = vreinterpretq_u32_u8(vqtbl1q_u8(vld1q_u8(src + 12 * i), vld1q_u8(shuf)));
+		idx = vorrq_u32(vorrq_u32(vandq_u32(vshrq_n_u32(v, 18), m),
+			vshlq_n_u32(vandq_u32(vshrq_n_u32(v, 12), m), 8)),
+			vorrq_u32(vshlq_n_u32(vandq_u32(vshrq_n_u32(v, 6), m), 16),
+			vshlq_n_u32(vandq_u32(v, m), 24)));
+		vst1q_u8(out + 16 * i, vqtbl4q_u8(tbl, vreinterpretq_u8_u32(idx)));
+	}
+}
+
+static inline int b64_simd_decode(const unsigned char *src, unsigned char *out)
+{
+	static const uint8_t shuf[16] = { 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, 0xff, 0xff, 0xff, 0xff };
+	uint8x16x4_t lo = { { vld1q_u8(base64_dtable), vld1q_u8(base64_dtable + 16),
+		vld1q_u8(base64_dtable + 32), vld1q_u8(base64_dtable + 48) } };
+	uint8x16x4_t hi = { { vld1q_u8(base64_dtable + 64), vld1q_u8(base64_dtable + 80),
+		vld1q_u8(base64_dtable + 96), vld1q_u8(base64_dtable + 112) } };
+	uint32x4_t m = vdupq_n_u32(0xff), w, x;
+	uint8x16_t c, v;
+	int i, bad = 0;
+
+	for (i = 0; i < 2; i++) {
+		/* values of the characters below 128, 0xff for the other ones */
+		c = vld1q_u8(src + 16 * i);
+		v = vqtbx4q_u8(vdupq_n_u8(0xff), lo, c);
+		v = vqtbx4q_u8(v, hi, vsubq_u8(c, vdupq_n_u8(64)));
+		bad |= vmaxvq_u8(v) > 63;
+		w = vreinterpretq_u32_u8(v);
+		x = vorrq_u32(vorrq_u32(vshlq_n_u32(vandq_u32(w, m), 18),
+			vshlq_n_u32(vandq_u32(vshrq_n_u32(w, 8), m), 12)),
+			vorrq_u32(vshlq_n_u32(vandq_u32(vshrq_n_u32(w, 16), m), 6),
+			vshrq_n_u32(w, 24)));
+		vst1q_u8(out + 12 * i, vqtbl1q_u8(vreinterpretq_u8_u32(x), vld1q_u8(shuf)));
+	}
+	return bad;
+}
+
+#else
+
+#define b64_simd_bytes 0
+
+#endif
+
+/*
+ * Encode the n keys of 32 bytes at keys into 44 characters and a NUL, at out,
+ * out + stride...
+ */
+void base64_encode_keys(const unsigned char *keys, size_t n, unsigned char *out, size_t stride)
+{
+	const unsigned char *in;
+	unsigned char *pos;
+	size_t k;
+	int i;
+
+	for (k = 0; k < n; k++, keys += 32, out += stride) {
+		in = keys;
+		pos = out;
+#if b64_simd_bytes
+		b64_simd_encode(in, pos);
+		in += b64_simd_bytes;
+		pos += b64_simd_bytes / 3 * 4;
+#endif
+		for (i = b64_simd_bytes; i < 30; i += 3) {
+			*pos++ = base64_table[in[0] >> 2];
+			*pos++ = base64_table[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+			*pos++ = base64_table[((in[1] & 0x0f) << 2) | (in[2] >> 6)];
+			*pos++ = base64_table[in[2] & 0x3f];
+			in += 3;
+		}
+		*pos++ = base64_table[in[0] >> 2];
+		*pos++ = base64_table[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+		*pos++ = base64_table[(in[1] & 0x0f) << 2];
+		*pos++ = '=';
+		*pos = 0;
+	}
+}
+
+/*
+ * Decode the n strings of 44 characters at in, in + stride... into keys of 32
+ * bytes. Only the canonical encoding of a key is accepted: 43 characters of
+ * the alphabet, the last one encoding 4 bits, and a '='.
+ * Returns n, or the index of the first invalid string (the keys before it
+ * are decoded).
+ */
+size_t base64_decode_keys(const unsigned char *in, size_t stride, size_t n, unsigned char *keys)
+{
+	const unsigned char *src;
+	unsigned char *pos, v[4];
+	size_t k;
+	int i, j;
+
+	for (k = 0; k < n; k++, in += stride, keys += 32) {
+		src = in;
+		pos = keys;
+#if b64_simd_bytes
+		if (b64_simd_decode(src, pos))
+			return k;
+		src += b64_simd_bytes / 3 * 4;
+		pos += b64_simd_bytes;
+#endif
+		for (i = b64_simd_bytes; i < 30; i += 3) {
+			for (j = 0; j < 4; j++)
+				if ((v[j] = base64_dtable[src[j]]) == 0xff)
+					return k;
+			*pos++ = (v[0] << 2) | (v[1] >> 4);
+			*pos++ = (v[1] << 4) | (v[2] >> 2);
+			*pos++ = (v[2] << 6) | v[3];
+			src += 4;
+		}
+		for (j = 0; j < 3; j++)
+			if ((v[j] = base64_dtable[src[j]]) == 0xff)
+				return k;
+		if (src[3] != '=' || (v[2] & 0x03))
+			return k;
+		*pos++ = (v[0] << 2) | (v[1] >> 4);
+		*pos++ = (v[1] << 4) | (v[2] >> 2);
+	}
+	return n;
+}
@@ -0,0 +1,255 @@
+/* Simple client/server for a NAT traversal and endpoint discovery protocol for Wireguard
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2022, Alexandre Janon <alex14fr@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "common.h"
+#include <netdb.h>
+
+// replication between the wgsigd nodes of a cluster
+//
+// each node sends the records updated by the requests it receives to the other nodes, and
+// merges the records it receives from them, keeping the one with the largest TAI64N label;
+// every anti_entropy_period seconds, it also sends them a digest of its database, and a node
+// receiving a digest sends back the records of the buckets which differ from its own
+//
+// messages are UDP datagrams TYPE(1) || COUNT(1) || TAI64N(12) || PAYLOAD || HMAC(32), HMAC
+// computed with the cluster key; PAYLOAD is COUNT records for updates, each followed by the
+// TAI64N label of the last update of its endpoint, and digest_buckets 8-byte hashes for digests
+
+#define max_nodes 16
+#define msg_update 'U'
+#define msg_digest 'D'
+#define msg_hdr_size 14
+#define repl_rec_size (rec_size+12)
+#define msg_max_recs ((max_datagram-msg_hdr_size-hmac_size)/repl_rec_size)
+#define digest_buckets 16
+#define anti_entropy_period 10
+
+static struct group_key cluster_key;
+static struct sockaddr_in nodes[max_nodes];
+static int n_nodes=0;
+static time_t next_digest=0;
+
+// fill the header and HMAC of a message with n bytes of payload
+// returns the size of the message
+static int msg_seal(uint8_t *msg, uint8_t type, uint8_t count, int n) {
+	struct timespec tp;
+	clock_gettime(CLOCK_REALTIME, &tp);
+	uint64_t tai64=htobe64(tp.tv_sec|((uint64_t)1<<62));
+	uint32_t tns=htobe32((uint32_t)tp.tv_nsec);
+	msg[0]=type;
+	msg[1]=count;
+	memcpy(msg+2, &tai64, 8);
+	memcpy(msg+10, &tns, 4);
+	hmac_sha256_pre(msg+msg_hdr_size+n, msg, msg_hdr_size+n, &cluster_key.hctx);
+	return(msg_hdr_size+n+hmac_size);
+}
+
+// send a message to the nodes, or to the single node dst
+static void msg_send(uint8_t *msg, int len, struct sockaddr_in *dst) {
+	struct iovec iov[max_nodes];
+	for(int i=0;i<n_nodes;i++) {
+		iov[i].iov_base=msg;
+		iov[i].iov_len=len;
+	}
+	int n=(dst ? 1 : n_nodes);
+	int sent=send_batch(cluster_sock, iov, (dst ? dst : nodes), n);
+	if(sent<0) perror("cluster sendmmsg");
+	else metric_add(repl_sent, sent);
+}
+
+// read the cluster key, resolve the comma-separated list of host:port of the other nodes
+// and open the replication socket on port
+// returns the socket
+int cluster_open(char *key_file, char *list, uint16_t port) {
+	if(load_key(&cluster_key, key_file)) exit(6);
+	// parse a copy, so that the command line shown by ps(1) is left intact
+	char *tok;
+	list=strdup(list);
+	for(tok=strtok(list, ","); tok; tok=strtok(NULL, ",")) {
+		if(n_nodes==max_nodes) {
+			printf("too many cluster nodes\n");
+			exit(1);
+		}
+		char *colon=strchr(tok, ':');
+		if(!colon) {
+			printf("%s : cluster node must be host:port\n", tok);
+			exit(1);
+		}
+		*colon=0;
+		struct addrinfo hints, *ai;
+		bzero(&hints, sizeof(struct addrinfo));
+		hints.ai_family=AF_INET;
+		hints.ai_socktype=SOCK_DGRAM;
+		if(getaddrinfo(tok, NULL, &hints, &ai) || !ai) {
+			printf("%s : host not found\n", tok);
+			exit(3);
+		}
+		memcpy(&nodes[n_nodes], ai->ai_addr, sizeof(struct sockaddr_in));
+		nodes[n_nodes++].sin_port=htons(atoi(colon+1));
+		freeaddrinfo(ai);
+	}
+	free(list);
+	cluster_sock=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	struct sockaddr_in saddr;
+	bzero(&saddr, sizeof(struct sockaddr_in));
+	saddr.sin_family=AF_INET;
+	saddr.sin_port=htons(port);
+	saddr.sin_addr.s_addr=INADDR_ANY;
+	if(cluster_sock<0 || bind(cluster_sock, (struct sockaddr*)&saddr, sizeof(struct sockaddr_in))) {
+		perror("cluster bind");
+		exit(1);
+	}
+	next_digest=time(NULL)+anti_entropy_period;
+	return(cluster_sock);
+}
+
+// copy a record of the database and the label of its endpoint to a message
+static void repl_rec(uint8_t *out, unsigned char *rec) {
+	memcpy(out, rec, rec_size);
+	memcpy(out+rec_size, peer_ep_label(rec), 12);
+}
+
+// send an updated record to the other nodes
+void cluster_publish(unsigned char *rec) {
+	uint8_t msg[msg_hdr_size+repl_rec_size+hmac_size];
+	repl_rec(msg+msg_hdr_size, rec);
+	msg_send(msg, msg_seal(msg, msg_update, 1, repl_rec_size), NULL);
+}
+
+static int bucket(unsigned char *rec) {
+	return(rec[0]*digest_buckets/256);
+}
+
+// digest of the records of the database: for each bucket, xor of the hashes of its records
+static void digest(uint64_t out[digest_buckets]) {
+	unsigned int n;
+	unsigned char *db=peer_db(&n);
+	bzero(out, digest_buckets*sizeof(uint64_t));
+	for(int i=0;i<n;i++) {
+		unsigned char *rec=db+i*rec_size;
+		uint8_t r[repl_rec_size], h[32];
+		uint64_t h64;
+		repl_rec(r, rec);
+		sha256_hash(h, r, repl_rec_size);
+		memcpy(&h64, h, 8);
+		out[bucket(rec)]^=h64;
+	}
+}
+
+// send the records of the buckets selected in the mask to dst
+static void send_buckets(uint32_t mask, struct sockaddr_in *dst) {
+	unsigned int n;
+	unsigned char *db=peer_db(&n);
+	uint8_t msg[msg_hdr_size+msg_max_recs*repl_rec_size+hmac_size];
+	int count=0;
+	for(int i=0;i<=n;i++) {
+		if(i<n && !(mask&(1<<bucket(db+i*rec_size)))) continue;
+		if(count==msg_max_recs || (i==n && count)) {
+			msg_send(msg, msg_seal(msg, msg_update, count, count*repl_rec_size), dst);
+			metric_add(ae_repairs, count);
+			count=0;
+		}
+		if(i<n)
+			repl_rec(msg+msg_hdr_size+(count++)*repl_rec_size, db+i*rec_size);
+	}
+}
+
+// process a datagram received on the replication socket
+void cluster_receive(void) {
+	uint8_t msg[msg_hdr_size+msg_max_recs*repl_rec_size+hmac_size];
+	struct sockaddr_in from;
+	socklen_t fromlen=sizeof(struct sockaddr_in);
+	int len=recvfrom(cluster_sock, msg, sizeof(msg), 0, (struct sockaddr*)&from, &fromlen);
+	if(len<0) return;
+	metric_add(repl_received, 1);
+	// only accept messages from the nodes, authenticated with the cluster key, and recent
+	struct sockaddr_in *node=NULL;
+	for(int i=0;i<n_nodes;i++)
+		if(nodes[i].sin_addr.s_addr==from.sin_addr.s_addr && nodes[i].sin_port==from.sin_port)
+			node=&nodes[i];
+	uint8_t hmac[32];
+	if(!node || len<msg_hdr_size+hmac_size) goto reject;
+	hmac_sha256_pre(hmac, msg, len-hmac_size, &cluster_key.hctx);
+	if(str_nequ_ctime(hmac, msg+len-hmac_size)) goto reject;
+	uint64_t sent;
+	memcpy(&sent, msg+2, 8);
+	sent=be64toh(sent)&(~((uint64_t)1<<62));
+	time_t now=time(NULL);
+	if(sent>now+30 || sent<now-30) goto reject;
+	int count=msg[1];
+	if(msg[0]==msg_update && len==msg_hdr_size+count*repl_rec_size+hmac_size) {
+		for(int i=0;i<count;i++) {
+			unsigned char *rec=msg+msg_hdr_size+i*repl_rec_size;
+			if(!peer_merge(rec, rec+rec_size)) continue;
+			// replication lag: age of the TAI64N label of the record when it is applied
+			struct timespec tp;
+			clock_gettime(CLOCK_REALTIME, &tp);
+			uint64_t sec;
+			uint32_t ns;
+			memcpy(&sec, rec+counter_off, 8);
+			memcpy(&ns, rec+counter_off+8, 4);
+			int64_t lag=((int64_t)tp.tv_sec-(int64_t)(be64toh(sec)&(~((uint64_t)1<<62))))*1000+(tp.tv_nsec/1000000-(int64_t)be32toh(ns)/1000000);
+			if(lag<0) lag=0;
+			metric_add(repl_applied, 1);
+			metric_add(repl_lag_sum, lag);
+			metric_set(repl_lag_last, lag);
+			if(lag>metrics.repl_lag_max) metric_set(repl_lag_max, lag);
+		}
+		return;
+	}
+	if(msg[0]==msg_digest && len==msg_hdr_size+digest_buckets*8+hmac_size) {
+		uint64_t mine[digest_buckets];
+		uint32_t mask=0;
+		digest(mine);
+		for(int i=0;i<digest_buckets;i++)
+			if(memcmp(&mine[i], msg+msg_hdr_size+i*8, 8))
+				mask|=1<<i;
+		if(mask) send_buckets(mask, node);
+		return;
+	}
+reject:
+	metric_add(repl_rejected, 1);
+}
+
+// send the digests when they are due
+// returns the delay until the next ones, in ms
+int cluster_tick(void) {
+	time_t now=time(NULL);
+	if(now>=next_digest) {
+		uint8_t msg[msg_hdr_size+digest_buckets*8+hmac_size];
+		uint64_t mine[digest_buckets];
+		digest(mine);
+		memcpy(msg+msg_hdr_size, mine, digest_buckets*8);
+		msg_send(msg, msg_seal(msg, msg_digest, digest_buckets, digest_buckets*8), NULL);
+		metric_add(ae_rounds, 1);
+		next_digest=now+anti_entropy_period;
+	}
+	return((next_digest-now)*1000);
+}
@@ -29,56 +29,134 @@
  */
 #include "common.h"
 
-unsigned char secret[32];
+struct group_key group_key;
 
-void read_secret(char *f) {
+// read a Group secret from file f into k, and derive its keys
+// returns 0 on success, -1 on error
+int load_key(struct group_key *k, char *f) {
 	struct stat statbuf;
 	// open secret file
 	int fd=open(f,O_RDONLY);
-	if(!fd) { printf("can't open() file %s\n", f); }
+	if(fd<0) { printf("can't open() file %s\n", f); return(-1); }
 	// must be user-readable (optionally user-writable) only, regular file of 32 bytes
 	int fs=fstat(fd,&statbuf);
 	if(fs<0 || ( statbuf.st_mode!=(S_IFREG|S_IRUSR) && statbuf.st_mode!=(S_IFREG|S_IRUSR|S_IWUSR) )) {
 		printf("file %s must be regular file, chmod 0400 or 0600\n", f);
-		exit(6);
+		close(fd);
+		return(-1);
 	}
-	if(read(fd,secret,32)<32) { printf("secret must be 32 bytes long\n"); exit(6); }
+	unsigned char secret[secret_size];
+	if(read(fd,secret,secret_size)<secret_size) { printf("secret must be 32 bytes long\n"); close(fd); return(-1); }
 	close(fd);
+	key_init(k, secret);
+	return(0);
+}
+
+// set up k for the Group secret secret, and derive its keys
+void key_init(struct group_key *k, const unsigned char *secret) {
+	static uint32_t serial=0;
+	memcpy(k->secret, secret, secret_size);
+	// precompute HMAC key blocks and ChaCha20 key
+	hmac_sha256_init(&k->hctx, k->secret, secret_size);
+	sha256_hash(k->enc_key, k->secret, secret_size);
+	// distinguishes keys loaded at different times, for the caches of signed datagrams
+	k->serial=__atomic_add_fetch(&serial, 1, __ATOMIC_SEQ_CST);
+}
+
+void read_secret(char *f) {
+	if(load_key(&group_key, f)) exit(6);
+}
+
+// dump a record in terse format or Wireguard configuration skeleton format, with its age at time now
+void print_record(uint8_t *rec, unsigned char *my_peer_id, uint8_t wgconf_format, time_t now) {
+	char buf[render_size(1)];
+	fwrite(buf, 1, render_records(buf, rec, 1, my_peer_id, (wgconf_format ? out_wgconf : out_terse), now), stdout);
+}
+
+// send n datagrams, with payloads iov and destinations dst, in one system call where sendmmsg(2) is available
+// returns the number of datagrams sent, or -1 if none could be sent
+int send_batch(int sock, struct iovec *iov, struct sockaddr_in *dst, int n) {
+#ifdef HAS_MMSG
+	struct mmsghdr msgs[n];
+	bzero(msgs, n*sizeof(struct mmsghdr));
+	for(int i=0;i<n;i++) {
+		msgs[i].msg_hdr.msg_iov=&iov[i];
+		msgs[i].msg_hdr.msg_iovlen=1;
+		msgs[i].msg_hdr.msg_name=&dst[i];
+		msgs[i].msg_hdr.msg_namelen=sizeof(struct sockaddr_in);
+	}
+	int done=0, sent=0, r;
+	while(done<n) {
+		// sendmmsg(2) stops at the first datagram which can not be sent: skip it
+		if((r=sendmmsg(sock, msgs+done, n-done, 0))<=0) {
+			done++;
+			continue;
+		}
+		done+=r;
+		sent+=r;
+	}
+	return(sent ? sent : -1);
+#else
+	int sent=0;
+	for(int i=0;i<n;i++)
+		if(sendto(sock, iov[i].iov_base, iov[i].iov_len, 0, (struct sockaddr*)&dst[i], sizeof(struct sockaddr_in))>=0)
+			sent++;
+	return(sent ? sent : -1);
+#endif
 }
 
-// dump a record in terse format or Wireguard configuration skeleton format
-void print_record(uint8_t *rec, unsigned char *my_peer_id, uint8_t wgconf_format) {
-	unsigned char peerid_b64[45];
-	bzero(peerid_b64, 45);
-	base64_encode(rec, 32, peerid_b64); 
-	uint32_t ip;
-	memcpy(&ip,rec+addr_off,4);
-	ip^=ip_mask;
-	uint16_t port;
-	memcpy(&port,rec+port_off,2);
-	port=ntohs(port);
-	int32_t timediff;
-	time_t now=time(NULL);
-	uint64_t pkt_tai64;
-	memcpy(&pkt_tai64,rec+peer_id_size+6,8);
-	pkt_tai64=be64toh(pkt_tai64)&(~(((uint64_t)1)<<62));
-	timediff=(uint64_t)now-pkt_tai64;
-	if(!wgconf_format) {
-		if(my_peer_id) {
-			if(!memcmp(rec, my_peer_id, peer_id_size))
-				printf("* ");
-			else 
-				printf("  ");
+// kernel receive time of a datagram (with SO_TIMESTAMPNS), zero if not given
+static void rx_timestamp(struct msghdr *mh, struct timespec *ts) {
+	bzero(ts, sizeof(struct timespec));
+#ifdef SCM_TIMESTAMPNS
+	for(struct cmsghdr *cm=CMSG_FIRSTHDR(mh); cm; cm=CMSG_NXTHDR(mh, cm))
+		if(cm->cmsg_level==SOL_SOCKET && cm->cmsg_type==SCM_TIMESTAMPNS)
+			memcpy(ts, CMSG_DATA(cm), sizeof(struct timespec));
+#endif
+}
+
+// receive up to n datagrams in iov, with their sources in src, their sizes in len, and their kernel receive
+// times in ts if not NULL, in one system call where recvmmsg(2) is available; only waits for the first one
+// if wait is set
+// returns the number of datagrams received, or -1 if none was
+int recv_batch(int sock, struct iovec *iov, struct sockaddr_in *src, int *len, struct timespec *ts, int n, int wait) {
+	union { struct cmsghdr align; char buf[CMSG_SPACE(sizeof(struct timespec))]; } ctrl[n];
+#ifdef HAS_MMSG
+	struct mmsghdr msgs[n];
+	bzero(msgs, n*sizeof(struct mmsghdr));
+	for(int i=0;i<n;i++) {
+		msgs[i].msg_hdr.msg_iov=&iov[i];
+		msgs[i].msg_hdr.msg_iovlen=1;
+		msgs[i].msg_hdr.msg_name=&src[i];
+		msgs[i].msg_hdr.msg_namelen=sizeof(struct sockaddr_in);
+		if(ts) {
+			msgs[i].msg_hdr.msg_control=ctrl[i].buf;
+			msgs[i].msg_hdr.msg_controllen=sizeof(ctrl[i].buf);
+		}
+	}
+	int r=recvmmsg(sock, msgs, n, (wait ? MSG_WAITFORONE : MSG_DONTWAIT), NULL);
+	for(int i=0;i<r;i++) {
+		len[i]=msgs[i].msg_len;
+		if(ts) rx_timestamp(&msgs[i].msg_hdr, &ts[i]);
+	}
+	return(r);
+#else
+	int r;
+	for(r=0;r<n;r++) {
+		struct msghdr mh;
+		bzero(&mh, sizeof(struct msghdr));
+		mh.msg_iov=&iov[r];
+		mh.msg_iovlen=1;
+		mh.msg_name=&src[r];
+		mh.msg_namelen=sizeof(struct sockaddr_in);
+		if(ts) {
+			mh.msg_control=ctrl[r].buf;
+			mh.msg_controllen=sizeof(ctrl[r].buf);
 		}
-		printf("%s %u.%u.%u.%u:%hu ", peerid_b64, (ip&255), (ip >> 8)&255, (ip >> 16)&255, (ip >> 24)&255, port);
-		if(timediff)
-			printf("%d\n", timediff);
-		else
-			printf("\n");
-	} else {
-		if(my_peer_id && !memcmp(rec, my_peer_id, peer_id_size)) 
-			printf("# Public endpoint = %u.%u.%u.%u:%hu\n\n", (ip&255), (ip >> 8)&255, (ip >> 16)&255, (ip >> 24)&255, port);
-		else 
-			printf("[Peer]\n# Seen %d s ago\nPublicKey = %s\nEndpoint = %u.%u.%u.%u:%hu\n\n", timediff, peerid_b64, ip&255, (ip>>8)&255, (ip>>16)&255, (ip>>24)&255, port);
+		if((len[r]=recvmsg(sock, &mh, (wait && !r ? 0 : MSG_DONTWAIT)))<0)
+			break;
+		if(ts) rx_timestamp(&mh, &ts[r]);
 	}
+	return(r ? r : -1);
+#endif
 }
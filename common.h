@@ -5,6 +5,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <netinet/in.h>
 #include <netinet/udp.h>
@@ -25,21 +26,248 @@
 #define pkt_group_off pkt_clflg_off+2
 #define pkt_hmac_off pkt_group_off+4
 #define hmac_size 32
+#define resp_size (keep_peers*rec_size+8+hmac_size)
+#define resp_svext_off (keep_peers*rec_size)
+#define resp_hmac_off (keep_peers*rec_size+8)
+#define resp_trailer_size (8+hmac_size)
+// compact response datagram carrying n records: COUNT, records, SVEXT, N_OTHER, GROUP, HMAC
+#define compact_size(n) (2+(n)*rec_size+resp_trailer_size)
+// largest UDP payload sent, fitting in a 1500-byte Ethernet frame, and largest number of records it can carry
+#define max_datagram 1472
+#define max_page_recs ((max_datagram-enc_overhead-compact_size(0))/rec_size)
+#define resp_max_size (compact_size(max_page_recs)+advice_size)
+#define max_pages 15
+#define max_peers (keep_peers*max_pages)
+// CLFLG bits: compact response datagrams, pages of the response datagrams indexed,
+// largest size of compact response datagrams (in 100 bytes), selection of a single response datagram (1-based)
+#define clflg_compact 0x0004
+#define clflg_paged 0x0008
+#define clflg_mtu_mask 0x00f0
+#define clflg_mtu_shift 4
+#define clflg_page_mask 0x0f00
+#define clflg_page_shift 8
+// CLFLG bit: subscribe the source address of the request to the pushes of the endpoint changes
+#define clflg_subscribe 0x1000
+// CLFLG bit: ask for the poll interval advised by the server, in an ADVICE field (2 bytes, in seconds) before
+// the SVEXT of compact response datagrams
+#define clflg_advice 0x2000
+#define advice_size 2
+// SVEXT bits
+#define svext_compact 0x0004
+#define svext_paged 0x0008
+#define svext_mtu_mask 0x00f0
+// the server accepts AEAD request datagrams
+#define svext_aead 0x0100
+// a push datagram, carrying records whose endpoint changed, outside of any exchange
+#define svext_push 0x0200
+// the request subscribed the client
+#define svext_subscribed 0x1000
+// the datagram carries ADVICE
+#define svext_advice 0x2000
 #define secret_size 32
+// bytes added by encrypted payloads: SGROUP and NONCE
+#ifdef ENC_PAYLOAD
+#define enc_overhead 16
+#else
+#define enc_overhead 0
+#endif
+// bytes added by AEAD payloads (SGROUP, NONCE and TAG), which replace the HMAC of the datagram; they need
+// encrypted payloads, and AEAD request datagrams are told apart from the other ones by their size
+#ifdef ENC_PAYLOAD
+#define aead_overhead 32
+#define is_aead_request(len) ((len)==pkt_size-hmac_size+aead_overhead)
+#else
+#define aead_overhead 0
+#define is_aead_request(len) 0
+#endif
 #define ip_mask htobe32(0x322dccac)
+// cookie challenges: MAGIC || COOKIE appended to request datagrams, and MAGIC || COOKIE || ECHO sent by a
+// server under load instead of the response, ECHO being the last 8 bytes of the request datagram
+#define cookie_magic 0x7767636b
+#define cookie_size 8
+#define cookie_trailer_size (4+cookie_size)
+#define cookie_reply_size (4+cookie_size+8)
 
 /* base64.c */
 extern void base64_encode(const unsigned char *src, size_t len, unsigned char *out);
 extern void base64_decode(const unsigned char *src, size_t len, unsigned char *out);
+// conversion of arrays of 32-byte keys, to NUL-terminated strings of 44 characters every stride bytes, and back
+extern void base64_encode_keys(const unsigned char *keys, size_t n, unsigned char *out, size_t stride);
+extern size_t base64_decode_keys(const unsigned char *in, size_t stride, size_t n, unsigned char *keys);
 /* hmac_sha256.c */
 extern uint8_t str_nequ_ctime(uint8_t *s1, uint8_t *s2);
 extern void sha256_hash(unsigned char *buf, const unsigned char *data, size_t size);
 extern void hmac_sha256(uint8_t out[32], const uint8_t *data, size_t data_len, const uint8_t *key, size_t key_len);
+typedef struct hmac_sha256_ctx { uint32_t istate[8]; uint32_t ostate[8]; } hmac_sha256_ctx;
+extern void hmac_sha256_init(hmac_sha256_ctx *ctx, const uint8_t *key, size_t key_len);
+extern void hmac_sha256_pre(uint8_t out[32], const uint8_t *data, size_t data_len, const hmac_sha256_ctx *ctx);
 /* common.c */
-extern unsigned char secret[32];
+// a Group secret, with the precomputed HMAC key blocks and ChaCha20 key derived from it
+struct group_key {
+	unsigned char secret[secret_size];
+	hmac_sha256_ctx hctx;
+	uint8_t enc_key[32];
+	uint32_t serial;
+};
+extern struct group_key group_key;
+extern int load_key(struct group_key *k, char *f);
+extern void key_init(struct group_key *k, const unsigned char *secret);
 extern void read_secret(char *f);
-extern void print_record(uint8_t *rec, unsigned char *my_peer_id, uint8_t wgconf_format);
+extern void print_record(uint8_t *rec, unsigned char *my_peer_id, uint8_t wgconf_format, time_t now);
+extern int send_batch(int sock, struct iovec *iov, struct sockaddr_in *dst, int n);
+extern int recv_batch(int sock, struct iovec *iov, struct sockaddr_in *src, int *len, struct timespec *ts, int n, int wait);
+/* poly1305.c */
+// Poly1305 state: r and the accumulator in limbs, pad, and the bytes of an incomplete block
+typedef struct poly1305_ctx { uint64_t r[5], h[5], pad[2]; uint8_t buf[16]; int n; } poly1305_ctx;
+extern void poly1305_init(poly1305_ctx *ctx, const uint8_t key[32]);
+extern void poly1305_update(poly1305_ctx *ctx, const uint8_t *m, size_t len);
+extern void poly1305_finish(poly1305_ctx *ctx, uint8_t mac[16]);
 /* enc_payload.c */
-extern int recvfrom_clear(int socket, uint8_t *inpacket, int clearsize, struct sockaddr *sa, socklen_t *salen, uint32_t *crypt_group);
-extern int sendto_clear(int socket, uint8_t *outpacket, int clearsize, struct sockaddr *sa, socklen_t salen, uint32_t crypt_group);
+// write the clearsize bytes of clear to pkt, encrypted if enabled; returns the size of the datagram
+extern int seal_payload(const struct group_key *key, uint8_t *clear, int clearsize, uint8_t *pkt, uint32_t crypt_group);
+extern int open_payload(const struct group_key *key, uint8_t *pkt, int len, uint8_t *clear, int clearsize, uint32_t *crypt_group);
+// same with an AEAD payload, the clear datagram without its HMAC; open_aead returns -1 if it is not authentic
+extern int seal_aead(const struct group_key *key, uint8_t *clear, int clearsize, uint8_t *pkt, uint32_t crypt_group);
+extern int open_aead(const struct group_key *key, uint8_t *pkt, int len, uint8_t *clear, int clearsize, uint32_t *crypt_group);
+extern int recvfrom_clear(int socket, const struct group_key *key, uint8_t *inpacket, int clearsize, struct sockaddr *sa, socklen_t *salen, uint32_t *crypt_group);
+extern int sendto_clear(int socket, const struct group_key *key, uint8_t *outpacket, int clearsize, struct sockaddr *sa, socklen_t salen, uint32_t crypt_group);
 
+/* server.c */
+// counters of the server, dumped on SIGUSR1: only written by the request loop
+struct metrics {
+	uint64_t requests, rejected, responses;
+	uint64_t repl_sent, repl_received, repl_rejected, repl_applied;
+	uint64_t repl_lag_sum, repl_lag_last, repl_lag_max, ae_rounds, ae_repairs;
+	uint64_t queue_known, queue_unknown, queue_unknown_max, shed;
+	uint64_t cookie_mode, cookie_replies, cookie_dropped;
+	uint64_t subscriptions, subscribers, pushes;
+	uint64_t poll_advice;
+};
+extern struct metrics metrics;
+#define metric_add(m, v) __atomic_add_fetch(&metrics.m, (v), __ATOMIC_RELAXED)
+#define metric_set(m, v) __atomic_store_n(&metrics.m, (v), __ATOMIC_RELAXED)
+extern unsigned char *peer_db(unsigned int *n);
+extern int peer_merge(unsigned char *rec, unsigned char *ep);
+extern unsigned char *peer_ep_label(unsigned char *rec);
+// requests are received in batches of up to rx_batch datagrams: those of the peers in the database are
+// handled at once, those of unknown peers wait in a ring of low_queue_size requests; when a batch is full,
+// the loop is falling behind, and only rx_budget requests are handled before the next batch, so that
+// the ring fills up and its oldest requests are dropped, rather than datagrams in the socket buffer
+#define rx_batch 32
+#define rx_budget 8
+#define low_queue_size 128
+struct request {
+	struct sockaddr_in addr;
+	struct timespec ts;
+	int len;
+	unsigned char pkt[pkt_size+enc_overhead+cookie_trailer_size];
+};
+extern void serve_batch(int sock, struct request *rx, int n);
+extern int server_pending(void);
+// the current Group secret, and the next one during a rotation
+struct keyring {
+	int n;
+	struct group_key k[2];
+};
+extern struct keyring *keys;
+extern struct keyring *keyring_load(char *secret_file, char *next_secret_file);
+extern struct whitelist *whitelist;
+extern int cluster_sock;
+extern void print_metrics(void);
+// cookies are required under load, always, or never (when replaying a trace)
+#define cookies_auto 0
+#define cookies_always 1
+#define cookies_never 2
+extern int cookie_policy;
+// time of the server, pinned to pinned_time if nonzero; with server_dry_run, responses are not sent
+extern time_t pinned_time;
+extern int server_dry_run;
+extern time_t server_time(void);
+// read-only export of the database in a POSIX shared memory object, written under a seqlock:
+// SEQ is odd while a record is updated, readers copy the database and retry if SEQ changed meanwhile
+#define shm_magic 0x77677362
+struct shm_db {
+	uint32_t magic, seq, n_used, pad;
+	uint64_t updates;
+	uint32_t moves[max_peers];
+	unsigned char recs[max_peers*rec_size];
+};
+extern struct shm_db *shm;
+extern int key_first(struct keyring *kr);
+extern int request_verify(struct keyring *kr, int first, struct request *rq, unsigned char *inpacket);
+extern int request_apply(int sock, struct keyring *kr, struct request *rq, unsigned char *inpacket, int i);
+
+/* pipeline.c */
+// number of verifier threads, 0 when the request loop handles the requests alone
+#define max_verifiers 16
+extern int verifiers;
+extern void pipeline_start(int n);
+extern void pipeline_run(int sock, struct keyring *kr, struct request **rq, int n);
+
+/* cluster.c */
+extern int cluster_open(char *key_file, char *list, uint16_t port);
+extern void cluster_publish(unsigned char *rec);
+extern void cluster_receive(void);
+extern int cluster_tick(void);
+
+/* siphash.c */
+extern uint64_t siphash24(const uint8_t key[16], const uint8_t *data, size_t len);
+
+/* stages.c */
+// with STAGE_STATS, time spent in each stage of the request handling: stage_begin(t) starts the
+// first stage, stage_end(s, t) ends stage s and starts the next one, stage_wait(ts) records the time
+// since the kernel received the request
+#define stage_queue 0
+#define stage_decrypt 1
+#define stage_auth 2
+#define stage_update 3
+#define stage_response 4
+#define stage_encrypt 5
+#define stage_send 6
+#define stage_total 7
+#define n_stages 8
+#ifdef STAGE_STATS
+extern uint64_t stage_clock(void);
+extern void stage_record(int s, uint64_t ns);
+extern void stage_add(int s, uint64_t *t);
+extern void stage_queued(struct timespec *ts);
+extern void print_stages(void);
+#define stage_begin(t) uint64_t t=stage_clock()
+#define stage_end(s, t) stage_add((s), &(t))
+#define stage_wait(ts) stage_queued(ts)
+#else
+#define stage_begin(t)
+#define stage_end(s, t) do {} while(0)
+#define stage_wait(ts) do {} while(0)
+#endif
+
+/* trace.c */
+#define trace_magic 0x77677374
+#define trace_hdr_size 16
+extern FILE *trace_create(char *name);
+extern void trace_write(FILE *f, struct request *rx, int n, uint64_t ns);
+extern FILE *trace_open(char *name);
+extern int trace_read(FILE *f, struct request *rq, uint64_t *ns);
+
+/* render.c */
+// output formats of peer records: terse, Wireguard configuration skeleton, JSON array, wg-quick configuration
+#define out_terse 0
+#define out_wgconf 1
+#define out_json 2
+#define out_wgquick 3
+// size of the buffer needed to render n records in any format
+#define render_size(n) (64+(n)*160)
+extern int render_format(char *name);
+extern size_t render_records(char *buf, uint8_t *recs, int n, unsigned char *my_peer_id, int fmt, time_t now);
+extern size_t render_view(char *buf, uint8_t *recs, int n, unsigned char *my_peer_id, int fmt, uint16_t port, time_t now);
+extern int write_all(int fd, char *buf, size_t len);
+
+/* whitelist.c */
+struct whitelist {
+	int n;
+	uint64_t *keys;
+	unsigned char *ids;
+};
+extern struct whitelist *whitelist_load(char *f);
+extern void whitelist_free(struct whitelist *wl);
+extern int whitelist_search(struct whitelist *wl, unsigned char *peer_id);
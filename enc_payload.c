@@ -32,15 +32,37 @@
 #include <assert.h>
 
 #ifndef ENC_PAYLOAD
-int recvfrom_clear(int socket, uint8_t *inpacket, int clearsize, struct sockaddr *sa, socklen_t *salen, uint32_t *crypt_group) {
+int open_payload(const struct group_key *key, uint8_t *pkt, int len, uint8_t *clear, int clearsize, uint32_t *crypt_group) {
+	if(crypt_group)
+		*crypt_group=0;
+	if(len<clearsize) clearsize=len;
+	memcpy(clear, pkt, clearsize);
+	return(clearsize);
+}
+
+int recvfrom_clear(int socket, const struct group_key *key, uint8_t *inpacket, int clearsize, struct sockaddr *sa, socklen_t *salen, uint32_t *crypt_group) {
 	if(crypt_group)
 		*crypt_group=0;
 	return recvfrom(socket, inpacket, clearsize, 0, sa, salen);
 }
 
-int sendto_clear(int socket, uint8_t *outpacket, int clearsize, struct sockaddr *sa, socklen_t salen, uint32_t crypt_group) {
+int seal_payload(const struct group_key *key, uint8_t *clear, int clearsize, uint8_t *pkt, uint32_t crypt_group) {
+	memcpy(pkt, clear, clearsize);
+	return(clearsize);
+}
+
+int sendto_clear(int socket, const struct group_key *key, uint8_t *outpacket, int clearsize, struct sockaddr *sa, socklen_t salen, uint32_t crypt_group) {
 	return sendto(socket, outpacket, clearsize, 0, sa, salen);
 }
+
+// AEAD payloads need encryption
+int seal_aead(const struct group_key *key, uint8_t *clear, int clearsize, uint8_t *pkt, uint32_t crypt_group) {
+	return(seal_payload(key, clear, clearsize, pkt, crypt_group));
+}
+
+int open_aead(const struct group_key *key, uint8_t *pkt, int len, uint8_t *clear, int clearsize, uint32_t *crypt_group) {
+	return(-1);
+}
 #else
 
 #include "chacha20.h"
@@ -61,52 +83,130 @@ void get_nonce(uint8_t *nonce) {
 #endif
 #endif
 
-static chacha_ctx chactx_i;
-static uint8_t chactx_i_ok=0;
-
-void setup_chactx(chacha_ctx *chctx) {
-	if(!chactx_i_ok) {
-		uint8_t shasecret[32];
-		sha256_hash(shasecret, secret, 32);
-		chacha_keysetup(&chactx_i, shasecret);
-		chactx_i_ok=1;
-	}
-	memcpy(chctx, &chactx_i, sizeof(chacha_ctx));
-}
-
-int recvfrom_clear(int socket, uint8_t *inpacket, int clearsize, struct sockaddr *sa, socklen_t *salen, uint32_t *crypt_group) {
-	assert(clearsize<=560);
-	uint8_t inpacket_enc[577];
-	int ret;
-	if((ret=recvfrom(socket, inpacket_enc, clearsize+16, 0, sa, salen))<0) return(ret);
+// decrypt the payload of the len-byte datagram pkt with key, into at most clearsize bytes of clear
+// returns the size of the payload, or -1 if the datagram is too short
+int open_payload(const struct group_key *key, uint8_t *pkt, int len, uint8_t *clear, int clearsize, uint32_t *crypt_group) {
+	if(len<16) return(-1);
+	if(len-16<clearsize) clearsize=len-16;
 	chacha_ctx chctx;
-	setup_chactx(&chctx);
+	chacha_keysetup(&chctx, key->enc_key);
 	uint8_t nonce[12];
-	memcpy(&nonce,inpacket_enc+4,12);
+	memcpy(&nonce,pkt+4,12);
 	uint32_t group;
-	memcpy(&group,inpacket_enc,4);
+	memcpy(&group,pkt,4);
 	uint32_t gmask=(nonce[8]<<24)|(nonce[9]<<16)|(nonce[10]<<8)|nonce[11];
 	group=ntohl(group)^gmask;
 	if(crypt_group)
 		*crypt_group=group;
 	chacha_ivsetup(&chctx, nonce, 1);
-	chacha_encrypt_bytes(&chctx, inpacket_enc+16, inpacket, clearsize);
+	chacha_encrypt_bytes(&chctx, pkt+16, clear, clearsize);
 	return(clearsize);
 }
 
-int sendto_clear(int socket, uint8_t *outpacket, int clearsize, struct sockaddr *sa, socklen_t salen, uint32_t crypt_group) {
-	assert(clearsize<=560);
+int recvfrom_clear(int socket, const struct group_key *key, uint8_t *inpacket, int clearsize, struct sockaddr *sa, socklen_t *salen, uint32_t *crypt_group) {
+	assert(clearsize+16<=max_datagram);
+	uint8_t inpacket_enc[max_datagram];
+	int ret;
+	if((ret=recvfrom(socket, inpacket_enc, clearsize+16, 0, sa, salen))<0) return(ret);
+	if((ret=open_payload(key, inpacket_enc, ret, inpacket, clearsize, crypt_group))<0) {
+		// too short to be decrypted, is not a valid datagram
+		return(0);
+	}
+	return(ret);
+}
+
+int seal_payload(const struct group_key *key, uint8_t *clear, int clearsize, uint8_t *pkt, uint32_t crypt_group) {
 	uint8_t nonce[12];
 	get_nonce(nonce);
 	uint32_t gmask=(nonce[8]<<24)|(nonce[9]<<16)|(nonce[10]<<8)|nonce[11];
 	uint32_t sgroup=htonl(crypt_group^gmask);
 	chacha_ctx chctx;
-	setup_chactx(&chctx);
+	chacha_keysetup(&chctx, key->enc_key);
 	chacha_ivsetup(&chctx, nonce, 1);
-	uint8_t outpacket_enc[577];
-	memcpy(outpacket_enc,&sgroup,4);
-	memcpy(outpacket_enc+4,&nonce,12);
-	chacha_encrypt_bytes(&chctx, outpacket, outpacket_enc+16, clearsize);
-	return sendto(socket, outpacket_enc, clearsize+16, 0, sa, salen);
+	memcpy(pkt,&sgroup,4);
+	memcpy(pkt+4,&nonce,12);
+	chacha_encrypt_bytes(&chctx, clear, pkt+16, clearsize);
+	return(clearsize+16);
+}
+
+int sendto_clear(int socket, const struct group_key *key, uint8_t *outpacket, int clearsize, struct sockaddr *sa, socklen_t salen, uint32_t crypt_group) {
+	assert(clearsize+16<=max_datagram);
+	uint8_t outpacket_enc[max_datagram];
+	return sendto(socket, outpacket_enc, seal_payload(key, outpacket, clearsize, outpacket_enc, crypt_group), 0, sa, salen);
+}
+
+// AEAD payloads: ChaCha20-Poly1305 (RFC 8439), SGROUP || NONCE || ciphertext || TAG, SGROUP || NONCE being
+// the associated data; the Poly1305 key is the first block of the keystream, which the other payloads
+// skip, so that both are encrypted alike; each 64-byte block is authenticated as soon as it is encrypted
+#define aead_block 64
+
+// set up the cipher for the nonce of header, and the authenticator of the payload following header
+static void aead_setup(const struct group_key *key, uint8_t *header, chacha_ctx *chctx, poly1305_ctx *p) {
+	uint8_t block0[aead_block];
+	bzero(block0, aead_block);
+	chacha_keysetup(chctx, key->enc_key);
+	chacha_ivsetup(chctx, header+4, 0);
+	chacha_encrypt_bytes(chctx, block0, block0, aead_block);
+	poly1305_init(p, block0);
+	poly1305_update(p, header, 16);
+}
+
+// authenticate the padding and the lengths, after the n bytes of ciphertext
+static void aead_tag(poly1305_ctx *p, int n, uint8_t tag[16]) {
+	uint8_t tail[16+16];
+	bzero(tail, sizeof(tail));
+	uint64_t lens[2]={ htole64(16), htole64(n) };
+	int pad=(16-n%16)%16;
+	memcpy(tail+pad, lens, 16);
+	poly1305_update(p, tail, pad+16);
+	poly1305_finish(p, tag);
+}
+
+int seal_aead(const struct group_key *key, uint8_t *clear, int clearsize, uint8_t *pkt, uint32_t crypt_group) {
+	uint8_t nonce[12];
+	get_nonce(nonce);
+	uint32_t gmask=(nonce[8]<<24)|(nonce[9]<<16)|(nonce[10]<<8)|nonce[11];
+	uint32_t sgroup=htonl(crypt_group^gmask);
+	memcpy(pkt,&sgroup,4);
+	memcpy(pkt+4,&nonce,12);
+	chacha_ctx chctx;
+	poly1305_ctx p;
+	aead_setup(key, pkt, &chctx, &p);
+	for(int i=0;i<clearsize;i+=aead_block) {
+		int n=(clearsize-i<aead_block ? clearsize-i : aead_block);
+		chacha_encrypt_bytes(&chctx, clear+i, pkt+16+i, n);
+		poly1305_update(&p, pkt+16+i, n);
+	}
+	aead_tag(&p, clearsize, pkt+16+clearsize);
+	return(clearsize+aead_overhead);
+}
+
+// decrypt the AEAD payload of the len-byte datagram pkt with key, into at most clearsize bytes of clear
+// returns the size of the payload, or -1 if the datagram is too short or long, or not authentic
+int open_aead(const struct group_key *key, uint8_t *pkt, int len, uint8_t *clear, int clearsize, uint32_t *crypt_group) {
+	int n=len-aead_overhead;
+	if(n<0 || n>clearsize) return(-1);
+	chacha_ctx chctx;
+	poly1305_ctx p;
+	aead_setup(key, pkt, &chctx, &p);
+	for(int i=0;i<n;i+=aead_block) {
+		int b=(n-i<aead_block ? n-i : aead_block);
+		poly1305_update(&p, pkt+16+i, b);
+		chacha_encrypt_bytes(&chctx, pkt+16+i, clear+i, b);
+	}
+	uint8_t tag[16], d=0;
+	aead_tag(&p, n, tag);
+	for(int i=0;i<16;i++)
+		d|=tag[i]^pkt[16+n+i];
+	if(d) {
+		bzero(clear, n);
+		return(-1);
+	}
+	if(crypt_group) {
+		uint32_t group;
+		memcpy(&group,pkt,4);
+		*crypt_group=ntohl(group)^((pkt[12]<<24)|(pkt[13]<<16)|(pkt[14]<<8)|pkt[15]);
+	}
+	return(n);
 }
 #endif /* ENC_PAYLOAD */
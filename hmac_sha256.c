@@ -1,6 +1,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include "common.h"
 
 uint8_t str_nequ_ctime(uint8_t *s1, uint8_t *s2) {
 	uint8_t r=0;
@@ -369,3 +370,52 @@ hmac_sha256 (uint8_t out[HMAC_SHA256_DIGEST_SIZE],
 
 /* // */
 
+
+/*
+ * HMAC with precomputed inner and outer states: the two key blocks are
+ * hashed once by hmac_sha256_init(), saving two compressions per message
+ */
+
+	void
+hmac_sha256_init (hmac_sha256_ctx *ctx, const uint8_t *key, size_t key_len)
+{
+	sha256_t ss;
+	uint8_t kh[SHA256_DIGEST_SIZE];
+	uint8_t kx[B];
+
+	if (key_len > B) {
+		sha256_hash (kh, key, key_len);
+		key_len = SHA256_DIGEST_SIZE;
+		key = kh;
+	}
+
+	for (size_t i = 0; i < key_len; i++) kx[i] = I_PAD ^ key[i];
+	for (size_t i = key_len; i < B; i++) kx[i] = I_PAD ^ 0;
+	sha256_init (&ss);
+	sha256_update (&ss, kx, B);
+	for (int i = 0; i < 8; i++) ctx->istate[i] = ss.state[i];
+
+	for (size_t i = 0; i < key_len; i++) kx[i] = O_PAD ^ key[i];
+	for (size_t i = key_len; i < B; i++) kx[i] = O_PAD ^ 0;
+	sha256_init (&ss);
+	sha256_update (&ss, kx, B);
+	for (int i = 0; i < 8; i++) ctx->ostate[i] = ss.state[i];
+}
+
+	void
+hmac_sha256_pre (uint8_t out[HMAC_SHA256_DIGEST_SIZE],
+		const uint8_t *data, size_t data_len,
+		const hmac_sha256_ctx *ctx)
+{
+	sha256_t ss;
+
+	for (int i = 0; i < 8; i++) ss.state[i] = ctx->istate[i];
+	ss.count = B;
+	sha256_update (&ss, data, data_len);
+	sha256_final (&ss, out);
+
+	for (int i = 0; i < 8; i++) ss.state[i] = ctx->ostate[i];
+	ss.count = B;
+	sha256_update (&ss, out, SHA256_DIGEST_SIZE);
+	sha256_final (&ss, out);
+}
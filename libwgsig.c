@@ -0,0 +1,234 @@
+/* libwgsig.c - Client library for a NAT traversal and endpoint discovery protocol for Wireguard
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2022, Alexandre Janon <alex14fr@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "wgsig.h"
+
+// set up a session for the client peer_id of the group of secret, accepting response datagrams
+// of at most max_size bytes
+void wgsig_init(struct wgsig_session *s, const unsigned char secret[secret_size], const unsigned char peer_id[peer_id_size], unsigned int max_size) {
+	bzero(s, sizeof(struct wgsig_session));
+	key_init(&s->key, secret);
+	memcpy(s->peer_id, peer_id, peer_id_size);
+	s->fmt=clflg_compact|clflg_paged|clflg_advice|(max_size/100<15 ? max_size/100 : 15)<<clflg_mtu_shift;
+}
+
+// forget the response received, before a new exchange
+void wgsig_start(struct wgsig_session *s) {
+	s->n_pages=0;
+	s->received=0;
+	s->restarts=0;
+	s->subscribed=0;
+	s->advice=0;
+	s->view.n=0;
+}
+
+// build a request of mode wgsig_register, wgsig_poll or wgsig_fetch to buf, for all the response
+// datagrams or only the one of index page (>=0), with the cookie c of the server if it gave one,
+// and as an AEAD payload if the server accepts them
+// returns the size of the datagram, or -1 if buf is too small
+int wgsig_request(struct wgsig_session *s, int mode, int page, struct wgsig_cookie *c, unsigned char *buf, size_t size) {
+	if(size<wgsig_request_max) return(-1);
+	uint8_t pkt[pkt_size];
+	bzero(pkt, pkt_size);
+	memcpy(pkt, s->peer_id, peer_id_size);
+	struct timespec tp;
+	clock_gettime(CLOCK_REALTIME,&tp);
+	// TAI64 generation: we set the 62nd bit and convert endianness
+	uint64_t tai64=htobe64(tp.tv_sec|((uint64_t)1<<62));
+	uint32_t tns=htobe32((uint32_t)tp.tv_nsec);
+	uint16_t clflg=htons(mode|s->fmt|(page>=0 ? (page+1)<<clflg_page_shift : 0));
+	memcpy(pkt+pkt_counter_off, &tai64, 8);
+	memcpy(pkt+pkt_counter_off+8, &tns, 4);
+	memcpy(pkt+pkt_clflg_off, &clflg, 2);
+	int len;
+	if(c && c->aead)
+		len=seal_aead(&s->key, pkt, pkt_size-hmac_size, buf, 0/*group*/);
+	else {
+		hmac_sha256_pre(pkt+pkt_hmac_off, pkt, pkt_size-hmac_size, &s->key.hctx);
+		len=seal_payload(&s->key, pkt, pkt_size, buf, 0/*group*/);
+	}
+	if(c) {
+		memcpy(c->echo, buf+len-8, 8);
+		if(c->valid) {
+			memcpy(buf+len, c->trailer, cookie_trailer_size);
+			len+=cookie_trailer_size;
+		}
+	}
+	return(len);
+}
+
+// process a datagram received from the server which was sent the requests with the cookie c
+// returns wgsig_in_complete once all the response datagrams were received, wgsig_in_partial for the other
+// ones, wgsig_in_duplicate for a response datagram already received, wgsig_in_cookie for a cookie reply
+// (the request must be sent again with the cookie), wgsig_in_push for a push datagram, whose records are
+// then in s->push, wgsig_in_invalid or wgsig_in_bad_hmac otherwise
+// a response datagram from another generation of the database, or with another number of datagrams, than
+// the previous ones replaces them, and increments s->restarts: the missing ones must be requested again
+int wgsig_input(struct wgsig_session *s, struct wgsig_cookie *c, const unsigned char *pkt, size_t len) {
+	uint32_t magic;
+	if(len<4) return(wgsig_in_invalid);
+	memcpy(&magic, pkt, 4);
+	if(c && len==cookie_reply_size && ntohl(magic)==cookie_magic && !memcmp(pkt+4+cookie_size, c->echo, 8)) {
+		memcpy(c->trailer, pkt, cookie_trailer_size);
+		c->valid=1;
+		return(wgsig_in_cookie);
+	}
+	if(len>wgsig_response_max) return(wgsig_in_invalid);
+	// responses to AEAD requests are AEAD payloads, without HMAC; those to the requests sent before the
+	// server was known to accept them are not
+	uint8_t inpacket[resp_max_size];
+	int n, mac=0;
+	if(!c || !c->aead || (n=open_aead(&s->key, (uint8_t*)pkt, len, inpacket, resp_max_size, NULL/*group*/))<0) {
+		n=open_payload(&s->key, (uint8_t*)pkt, len, inpacket, resp_max_size, NULL/*group*/);
+		if(n<compact_size(0)) return(wgsig_in_invalid);
+		// verify response HMAC
+		uint8_t hmac[32];
+		hmac_sha256_pre(hmac, inpacket, n-hmac_size, &s->key.hctx);
+		if(str_nequ_ctime(hmac, inpacket+n-hmac_size)) return(wgsig_in_bad_hmac);
+		mac=hmac_size;
+	} else if(n<compact_size(0)-hmac_size)
+		return(wgsig_in_invalid);
+	uint16_t svext, n_other;
+	uint8_t *trailer=inpacket+n-(resp_trailer_size-hmac_size+mac);
+	memcpy(&svext, trailer, 2);
+	memcpy(&n_other, trailer+2, 2);
+	svext=ntohs(svext);
+	n_other=ntohs(n_other);
+	if(c && (svext&svext_aead) && aead_overhead)
+		c->aead=1;
+	// compact datagrams carry only the records in use, after their count, and may carry ADVICE
+	uint8_t *recs=inpacket;
+	int n_recs=keep_peers, compact=0;
+	if(svext&svext_compact) {
+		uint16_t count;
+		memcpy(&count, inpacket, 2);
+		n_recs=ntohs(count);
+		int extra=(svext&svext_advice ? advice_size : 0);
+		if(n_recs>max_page_recs || n+hmac_size-mac!=compact_size(n_recs)+extra) return(wgsig_in_invalid);
+		if(extra) {
+			uint16_t advice;
+			memcpy(&advice, trailer-advice_size, advice_size);
+			s->advice=ntohs(advice);
+		}
+		recs+=2;
+		compact=1;
+	} else if(n+hmac_size-mac!=resp_size)
+		return(wgsig_in_invalid);
+	if(svext&svext_push) {
+		if(!compact) return(wgsig_in_invalid);
+		s->push.n=n_recs;
+		memcpy(s->push.recs, recs, n_recs*rec_size);
+		return(wgsig_in_push);
+	}
+	if(svext&svext_subscribed)
+		s->subscribed=1;
+	// without indexed datagrams, only the first one can be used
+	int page=0, n_pages=1;
+	uint32_t gen=0;
+	if(svext&svext_paged) {
+		page=n_other>>8;
+		n_pages=(n_other&255)+1;
+		memcpy(&gen, trailer+4, 4);
+		gen=ntohl(gen);
+	}
+	if(n_pages>max_pages) n_pages=max_pages;
+	if(page>=n_pages) return(wgsig_in_invalid);
+	// the records moved between the datagrams since the first one was sent: collect them again
+	if(s->n_pages && (n_pages!=s->n_pages || gen!=s->gen)) {
+		s->received=0;
+		s->view.n=0;
+		s->restarts++;
+	}
+	if(s->received&(1<<page)) return(wgsig_in_duplicate);
+	s->n_pages=n_pages;
+	s->gen=gen;
+	s->received|=1<<page;
+	for(int i=0;i<n_recs && s->view.n<max_peers;i++) {
+		uint8_t *rec=recs+i*rec_size;
+		if(!compact) {
+			int j;
+			for(j=0;j<rec_size && !rec[j];j++);
+			if(j==rec_size) continue;
+		}
+		memcpy(s->view.recs+(s->view.n++)*rec_size, rec, rec_size);
+	}
+	return(s->received==(1<<s->n_pages)-1 ? wgsig_in_complete : wgsig_in_partial);
+}
+
+// bitmap of the response datagrams not received yet, once the first one was
+uint16_t wgsig_missing(struct wgsig_session *s) {
+	return(s->n_pages ? ((1<<s->n_pages)-1)&~s->received : 0);
+}
+
+// copy the peers received, starting from index first, to out
+// returns their number
+int wgsig_peers(struct wgsig_session *s, int first, struct wgsig_peer *out, int max) {
+	int n=0;
+	for(int i=first;i<s->view.n && n<max;i++,n++) {
+		uint8_t *rec=s->view.recs+i*rec_size;
+		struct wgsig_peer *p=&out[n];
+		memcpy(p->public_key, rec, peer_id_size);
+		bzero(&p->endpoint, sizeof(struct sockaddr_in));
+		p->endpoint.sin_family=AF_INET;
+		uint32_t addr;
+		memcpy(&addr, rec+addr_off, 4);
+		addr^=ip_mask;
+		memcpy(&p->endpoint.sin_addr, &addr, 4);
+		memcpy(&p->endpoint.sin_port, rec+port_off, 2);
+		uint64_t sec;
+		uint32_t ns;
+		memcpy(&sec, rec+counter_off, 8);
+		memcpy(&ns, rec+counter_off+8, 4);
+		p->seen=be64toh(sec)&~((uint64_t)1<<62);
+		p->seen_ns=be32toh(ns);
+		p->self=!memcmp(rec, s->peer_id, peer_id_size);
+	}
+	return(n);
+}
+
+// apply the records of delta to v: add those of new peers, and replace those with an older TAI64N label,
+// so that a push datagram replayed or received late does not bring back a previous endpoint
+// returns the number of records changed
+int wgsig_merge(struct wgsig_view *v, const struct wgsig_view *delta) {
+	int changed=0;
+	for(int i=0;i<delta->n;i++) {
+		const uint8_t *rec=delta->recs+i*rec_size;
+		int j;
+		for(j=0;j<v->n && memcmp(v->recs+j*rec_size, rec, peer_id_size);j++);
+		if(j==v->n) {
+			if(v->n==max_peers) continue;
+			v->n++;
+		} else if(memcmp(rec+counter_off, v->recs+j*rec_size+counter_off, 12)<=0)
+			continue;
+		memcpy(v->recs+j*rec_size, rec, rec_size);
+		changed++;
+	}
+	return(changed);
+}
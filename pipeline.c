@@ -0,0 +1,146 @@
+/* pipeline.c - Verifier threads for a NAT traversal and endpoint discovery protocol for Wireguard
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2022, Alexandre Janon <alex14fr@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include "common.h"
+
+// pipelined mode: the request loop receives the datagrams, checks the cookies and sorts the requests of
+// known and unknown peers, then hands the requests to handle to verifier threads, each through a
+// single-producer single-consumer ring; the verifiers decrypt and authenticate them, which does not depend
+// on the database, while the request loop applies the verified requests to the database in the order they
+// were received, and queues their responses
+// the request loop verifies a share of the requests itself, and all of them are handled before the next
+// batch is received, so that the keyring and the whitelist are not replaced while the verifiers use them
+
+// power of 2, and at least the number of requests handled per batch, so that pushes never fail as the rings
+// are emptied at each batch
+#define ring_size 256
+
+// a request handed to a verifier, the key to try first, and once done, the index of the key which
+// authenticated it (or -1), and its decrypted payload
+struct slot {
+	struct request *rq;
+	struct keyring *kr;
+	int first, key;
+	int done;
+	unsigned char inpacket[pkt_size];
+};
+
+// indexes of slots, written by the request loop at tail, read by the verifier at head
+struct ring {
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t tail __attribute__((aligned(64)));
+	uint16_t slot[ring_size];
+	sem_t wake;
+};
+
+static struct slot slots[rx_batch+low_queue_size];
+static struct ring rings[max_verifiers];
+int verifiers=0;
+
+static int ring_push(struct ring *r, uint16_t i) {
+	uint32_t tail=r->tail;
+	if(tail-__atomic_load_n(&r->head, __ATOMIC_ACQUIRE)==ring_size) return(0);
+	r->slot[tail&(ring_size-1)]=i;
+	__atomic_store_n(&r->tail, tail+1, __ATOMIC_RELEASE);
+	return(1);
+}
+
+static int ring_pop(struct ring *r, uint16_t *i) {
+	uint32_t head=r->head;
+	if(head==__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) return(0);
+	*i=r->slot[head&(ring_size-1)];
+	__atomic_store_n(&r->head, head+1, __ATOMIC_RELEASE);
+	return(1);
+}
+
+static void verify_slot(struct slot *s) {
+	s->key=request_verify(s->kr, s->first, s->rq, s->inpacket);
+	__atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+}
+
+// verifier thread: handle the slots of its ring, and sleep when it is empty
+static void *verifier(void *arg) {
+	struct ring *r=arg;
+	uint16_t i;
+	for(;;) {
+		while(!ring_pop(r, &i))
+			sem_wait(&r->wake);
+		verify_slot(&slots[i]);
+	}
+	return(NULL);
+}
+
+// start n verifier threads
+void pipeline_start(int n) {
+	for(verifiers=0;verifiers<n && verifiers<max_verifiers;verifiers++) {
+		pthread_t tid;
+		sem_init(&rings[verifiers].wake, 0, 0);
+		if(pthread_create(&tid, NULL, verifier, &rings[verifiers])) {
+			printf("can't create verifier thread\n");
+			exit(1);
+		}
+	}
+}
+
+// handle the n requests of rq: verified by the verifiers and the request loop, then applied in order
+void pipeline_run(int sock, struct keyring *kr, struct request **rq, int n) {
+	int first=key_first(kr), woken[max_verifiers]={ 0 };
+	for(int i=0;i<n;i++) {
+		struct slot *s=&slots[i];
+		s->rq=rq[i];
+		s->kr=kr;
+		s->first=first;
+		s->done=0;
+	}
+	// the request loop keeps one share, starting with the first request, so that a lone request does not
+	// wait for a verifier to wake up
+	for(int i=0;i<n;i++) {
+		int v=i%(verifiers+1)-1;
+		if(v>=0) {
+			ring_push(&rings[v], i);
+			woken[v]=1;
+		}
+	}
+	for(int v=0;v<verifiers;v++)
+		if(woken[v]) sem_post(&rings[v].wake);
+	for(int i=0;i<n;i+=verifiers+1)
+		verify_slot(&slots[i]);
+	for(int i=0;i<n;i++) {
+		struct slot *s=&slots[i];
+		while(!__atomic_load_n(&s->done, __ATOMIC_ACQUIRE))
+			sched_yield();
+		stage_begin(start);
+		if(request_apply(sock, kr, s->rq, s->inpacket, s->key))
+			stage_end(stage_total, start);
+	}
+}
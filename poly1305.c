@@ -0,0 +1,236 @@
+/* poly1305.c - Poly1305 one-time authenticator for a NAT traversal and endpoint discovery protocol for Wireguard
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2022, Alexandre Janon <alex14fr@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "common.h"
+
+// Poly1305 (Bernstein, RFC 8439), the authenticator of the AEAD payloads: the message, in 16-byte
+// blocks with a 1 appended, is evaluated as a polynomial in r modulo 2^130-5, and pad is added
+//
+// the accumulator and r are split into 3 limbs of 44 bits when 128-bit products are available,
+// or into 5 limbs of 26 bits, the carries being delayed until the products are summed
+
+#ifdef __SIZEOF_INT128__
+typedef unsigned __int128 u128;
+#define mask44 0xfffffffffffULL
+#define mask42 0x3ffffffffffULL
+
+static uint64_t load64le(const uint8_t *p) {
+	uint64_t x;
+	memcpy(&x, p, 8);
+	return(le64toh(x));
+}
+
+void poly1305_init(poly1305_ctx *ctx, const uint8_t key[32]) {
+	uint64_t t0=load64le(key), t1=load64le(key+8);
+	// clamp r
+	ctx->r[0]=t0&0xffc0fffffffULL;
+	ctx->r[1]=((t0>>44)|(t1<<20))&0xfffffc0ffffULL;
+	ctx->r[2]=(t1>>24)&0x00ffffffc0fULL;
+	ctx->h[0]=ctx->h[1]=ctx->h[2]=0;
+	ctx->pad[0]=load64le(key+16);
+	ctx->pad[1]=load64le(key+24);
+	ctx->n=0;
+}
+
+// add the 16-byte blocks of m to the accumulator, with 2^128 added to each, unless it is the padded last block
+static void poly1305_blocks(poly1305_ctx *ctx, const uint8_t *m, size_t len, int padded) {
+	uint64_t r0=ctx->r[0], r1=ctx->r[1], r2=ctx->r[2];
+	uint64_t s1=r1*(5<<2), s2=r2*(5<<2);
+	uint64_t h0=ctx->h[0], h1=ctx->h[1], h2=ctx->h[2], c;
+	uint64_t hibit=(padded ? 0 : (uint64_t)1<<40);
+	for(;len>=16;len-=16,m+=16) {
+		uint64_t t0=load64le(m), t1=load64le(m+8);
+		h0+=t0&mask44;
+		h1+=((t0>>44)|(t1<<20))&mask44;
+		h2+=((t1>>24)&mask42)|hibit;
+		u128 d0=(u128)h0*r0+(u128)h1*s2+(u128)h2*s1;
+		u128 d1=(u128)h0*r1+(u128)h1*r0+(u128)h2*s2;
+		u128 d2=(u128)h0*r2+(u128)h1*r1+(u128)h2*r0;
+		c=(uint64_t)(d0>>44);
+		h0=(uint64_t)d0&mask44;
+		d1+=c;
+		c=(uint64_t)(d1>>44);
+		h1=(uint64_t)d1&mask44;
+		d2+=c;
+		c=(uint64_t)(d2>>42);
+		h2=(uint64_t)d2&mask42;
+		h0+=c*5;
+		c=h0>>44;
+		h0&=mask44;
+		h1+=c;
+	}
+	ctx->h[0]=h0;
+	ctx->h[1]=h1;
+	ctx->h[2]=h2;
+}
+
+// reduce the accumulator modulo 2^130-5, and add pad
+static void poly1305_tag(poly1305_ctx *ctx, uint8_t mac[16]) {
+	uint64_t h0=ctx->h[0], h1=ctx->h[1], h2=ctx->h[2], c;
+	c=h1>>44; h1&=mask44; h2+=c;
+	c=h2>>42; h2&=mask42; h0+=c*5;
+	c=h0>>44; h0&=mask44; h1+=c;
+	c=h1>>44; h1&=mask44; h2+=c;
+	c=h2>>42; h2&=mask42; h0+=c*5;
+	c=h0>>44; h0&=mask44; h1+=c;
+	// h-p, selected if h>=p
+	uint64_t g0=h0+5;
+	c=g0>>44; g0&=mask44;
+	uint64_t g1=h1+c;
+	c=g1>>44; g1&=mask44;
+	uint64_t g2=h2+c-((uint64_t)1<<42);
+	c=(g2>>63)-1;
+	h0=(h0&~c)|(g0&c);
+	h1=(h1&~c)|(g1&c);
+	h2=(h2&~c)|(g2&c);
+	uint64_t t0=ctx->pad[0], t1=ctx->pad[1];
+	h0+=t0&mask44;
+	c=h0>>44; h0&=mask44;
+	h1+=(((t0>>44)|(t1<<20))&mask44)+c;
+	c=h1>>44; h1&=mask44;
+	h2+=((t1>>24)&mask42)+c;
+	t0=htole64(h0|(h1<<44));
+	t1=htole64((h1>>20)|(h2<<24));
+	memcpy(mac, &t0, 8);
+	memcpy(mac+8, &t1, 8);
+}
+#else
+#define mask26 0x3ffffff
+
+static uint32_t load32le(const uint8_t *p) {
+	uint32_t x;
+	memcpy(&x, p, 4);
+	return(le32toh(x));
+}
+
+void poly1305_init(poly1305_ctx *ctx, const uint8_t key[32]) {
+	// clamp r
+	ctx->r[0]=load32le(key)&0x3ffffff;
+	ctx->r[1]=(load32le(key+3)>>2)&0x3ffff03;
+	ctx->r[2]=(load32le(key+6)>>4)&0x3ffc0ff;
+	ctx->r[3]=(load32le(key+9)>>6)&0x3f03fff;
+	ctx->r[4]=(load32le(key+12)>>8)&0x00fffff;
+	for(int i=0;i<5;i++)
+		ctx->h[i]=0;
+	ctx->pad[0]=load32le(key+16)|(uint64_t)load32le(key+20)<<32;
+	ctx->pad[1]=load32le(key+24)|(uint64_t)load32le(key+28)<<32;
+	ctx->n=0;
+}
+
+// add the 16-byte blocks of m to the accumulator, with 2^128 added to each, unless it is the padded last block
+static void poly1305_blocks(poly1305_ctx *ctx, const uint8_t *m, size_t len, int padded) {
+	uint32_t r0=ctx->r[0], r1=ctx->r[1], r2=ctx->r[2], r3=ctx->r[3], r4=ctx->r[4];
+	uint32_t s1=r1*5, s2=r2*5, s3=r3*5, s4=r4*5;
+	uint32_t h0=ctx->h[0], h1=ctx->h[1], h2=ctx->h[2], h3=ctx->h[3], h4=ctx->h[4], c;
+	uint32_t hibit=(padded ? 0 : 1<<24);
+	for(;len>=16;len-=16,m+=16) {
+		h0+=load32le(m)&mask26;
+		h1+=(load32le(m+3)>>2)&mask26;
+		h2+=(load32le(m+6)>>4)&mask26;
+		h3+=(load32le(m+9)>>6)&mask26;
+		h4+=(load32le(m+12)>>8)|hibit;
+		uint64_t d0=(uint64_t)h0*r0+(uint64_t)h1*s4+(uint64_t)h2*s3+(uint64_t)h3*s2+(uint64_t)h4*s1;
+		uint64_t d1=(uint64_t)h0*r1+(uint64_t)h1*r0+(uint64_t)h2*s4+(uint64_t)h3*s3+(uint64_t)h4*s2;
+		uint64_t d2=(uint64_t)h0*r2+(uint64_t)h1*r1+(uint64_t)h2*r0+(uint64_t)h3*s4+(uint64_t)h4*s3;
+		uint64_t d3=(uint64_t)h0*r3+(uint64_t)h1*r2+(uint64_t)h2*r1+(uint64_t)h3*r0+(uint64_t)h4*s4;
+		uint64_t d4=(uint64_t)h0*r4+(uint64_t)h1*r3+(uint64_t)h2*r2+(uint64_t)h3*r1+(uint64_t)h4*r0;
+		c=(uint32_t)(d0>>26); h0=(uint32_t)d0&mask26;
+		d1+=c; c=(uint32_t)(d1>>26); h1=(uint32_t)d1&mask26;
+		d2+=c; c=(uint32_t)(d2>>26); h2=(uint32_t)d2&mask26;
+		d3+=c; c=(uint32_t)(d3>>26); h3=(uint32_t)d3&mask26;
+		d4+=c; c=(uint32_t)(d4>>26); h4=(uint32_t)d4&mask26;
+		h0+=c*5; c=h0>>26; h0&=mask26;
+		h1+=c;
+	}
+	ctx->h[0]=h0;
+	ctx->h[1]=h1;
+	ctx->h[2]=h2;
+	ctx->h[3]=h3;
+	ctx->h[4]=h4;
+}
+
+// reduce the accumulator modulo 2^130-5, and add pad
+static void poly1305_tag(poly1305_ctx *ctx, uint8_t mac[16]) {
+	uint32_t h0=ctx->h[0], h1=ctx->h[1], h2=ctx->h[2], h3=ctx->h[3], h4=ctx->h[4], c;
+	c=h1>>26; h1&=mask26; h2+=c;
+	c=h2>>26; h2&=mask26; h3+=c;
+	c=h3>>26; h3&=mask26; h4+=c;
+	c=h4>>26; h4&=mask26; h0+=c*5;
+	c=h0>>26; h0&=mask26; h1+=c;
+	// h-p, selected if h>=p
+	uint32_t g0=h0+5; c=g0>>26; g0&=mask26;
+	uint32_t g1=h1+c; c=g1>>26; g1&=mask26;
+	uint32_t g2=h2+c; c=g2>>26; g2&=mask26;
+	uint32_t g3=h3+c; c=g3>>26; g3&=mask26;
+	uint32_t g4=h4+c-(1<<26);
+	c=(g4>>31)-1;
+	h0=(h0&~c)|(g0&c);
+	h1=(h1&~c)|(g1&c);
+	h2=(h2&~c)|(g2&c);
+	h3=(h3&~c)|(g3&c);
+	h4=(h4&~c)|(g4&c);
+	uint32_t w[4]={ h0|(h1<<26), (h1>>6)|(h2<<20), (h2>>12)|(h3<<14), (h3>>18)|(h4<<8) };
+	uint32_t pad[4]={ (uint32_t)ctx->pad[0], ctx->pad[0]>>32, (uint32_t)ctx->pad[1], ctx->pad[1]>>32 };
+	uint64_t f=0;
+	for(int i=0;i<4;i++) {
+		f=(uint64_t)w[i]+pad[i]+(f>>32);
+		uint32_t le=htole32((uint32_t)f);
+		memcpy(mac+4*i, &le, 4);
+	}
+}
+#endif
+
+// add len bytes of m to the message
+void poly1305_update(poly1305_ctx *ctx, const uint8_t *m, size_t len) {
+	if(ctx->n) {
+		while(len && ctx->n<16) {
+			ctx->buf[ctx->n++]=*m++;
+			len--;
+		}
+		if(ctx->n<16) return;
+		poly1305_blocks(ctx, ctx->buf, 16, 0);
+		ctx->n=0;
+	}
+	poly1305_blocks(ctx, m, len&~15, 0);
+	m+=len&~15;
+	for(len&=15;len;len--)
+		ctx->buf[ctx->n++]=*m++;
+}
+
+// write the authenticator of the message to mac
+void poly1305_finish(poly1305_ctx *ctx, uint8_t mac[16]) {
+	if(ctx->n) {
+		ctx->buf[ctx->n++]=1;
+		while(ctx->n<16)
+			ctx->buf[ctx->n++]=0;
+		poly1305_blocks(ctx, ctx->buf, 16, 1);
+	}
+	poly1305_tag(ctx, mac);
+}
@@ -0,0 +1,154 @@
+/* whitelist.c - Peer ID whitelist for a NAT traversal and endpoint discovery protocol for Wireguard
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2022, Alexandre Janon <alex14fr@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "common.h"
+
+// formatting of peer records, in a caller-provided buffer of at least render_size(n) bytes for n records
+
+static const char *format_names[]={ "terse", "wg", "json", "wgquick" };
+
+// returns the output format named name, or -1
+int render_format(char *name) {
+	for(int i=0;i<sizeof(format_names)/sizeof(format_names[0]);i++)
+		if(!strcmp(name, format_names[i]))
+			return(i);
+	return(-1);
+}
+
+static char *put_str(char *p, const char *s) {
+	while(*s) *p++=*s++;
+	return(p);
+}
+
+static char *put_int(char *p, int64_t v) {
+	char tmp[20];
+	int n=0;
+	uint64_t u=(v<0 ? -(uint64_t)v : (uint64_t)v);
+	if(v<0) *p++='-';
+	do {
+		tmp[n++]='0'+u%10;
+		u/=10;
+	} while(u);
+	while(n) *p++=tmp[--n];
+	return(p);
+}
+
+static char *put_endpoint(char *p, uint8_t *rec) {
+	uint32_t ip;
+	memcpy(&ip,rec+addr_off,4);
+	ip^=ip_mask;
+	uint16_t port;
+	memcpy(&port,rec+port_off,2);
+	for(int i=0;i<4;i++) {
+		p=put_int(p, (ip>>(8*i))&255);
+		*p++=(i<3 ? '.' : ':');
+	}
+	return(put_int(p, ntohs(port)));
+}
+
+// write the n records at recs in format fmt to buf, marking the one of my_peer_id (if not NULL)
+// now is the current time, for the age of the records
+// returns the number of bytes written
+size_t render_records(char *buf, uint8_t *recs, int n, unsigned char *my_peer_id, int fmt, time_t now) {
+	char *p=buf;
+	for(int i=0;i<n;i++) {
+		uint8_t *rec=recs+i*rec_size;
+		unsigned char peerid_b64[45];
+		base64_encode_keys(rec, 1, peerid_b64, 45);
+		uint64_t pkt_tai64;
+		memcpy(&pkt_tai64,rec+peer_id_size+6,8);
+		pkt_tai64=be64toh(pkt_tai64)&(~(((uint64_t)1)<<62));
+		int32_t timediff=(uint64_t)now-pkt_tai64;
+		int self=(my_peer_id && !memcmp(rec, my_peer_id, peer_id_size));
+		switch(fmt) {
+			case out_terse:
+				if(my_peer_id)
+					p=put_str(p, self ? "* " : "  ");
+				p=put_str(p, (char*)peerid_b64);
+				*p++=' ';
+				p=put_endpoint(p, rec);
+				*p++=' ';
+				if(timediff)
+					p=put_int(p, timediff);
+				*p++='\n';
+				break;
+			case out_wgconf:
+				if(self) {
+					p=put_endpoint(put_str(p, "# Public endpoint = "), rec);
+					p=put_str(p, "\n\n");
+				} else {
+					p=put_int(put_str(p, "[Peer]\n# Seen "), timediff);
+					p=put_str(put_str(put_str(p, " s ago\nPublicKey = "), (char*)peerid_b64), "\nEndpoint = ");
+					p=put_str(put_endpoint(p, rec), "\n\n");
+				}
+				break;
+			case out_json:
+				p=put_str(put_str(put_str(p, (i ? ",\n" : "")), "{\"public_key\": \""), (char*)peerid_b64);
+				p=put_endpoint(put_str(p, "\", \"endpoint\": \""), rec);
+				p=put_int(put_str(p, "\", \"age\": "), timediff);
+				p=put_str(p, self ? ", \"self\": true}" : ", \"self\": false}");
+				break;
+			case out_wgquick:
+				if(self) break;
+				p=put_str(put_str(put_str(p, "[Peer]\nPublicKey = "), (char*)peerid_b64), "\nEndpoint = ");
+				p=put_str(put_endpoint(p, rec), "\n\n");
+				break;
+		}
+	}
+	return(p-buf);
+}
+
+// write a whole view of n records in format fmt to buf, with the [Interface] section for port if nonzero
+// returns the number of bytes written
+size_t render_view(char *buf, uint8_t *recs, int n, unsigned char *my_peer_id, int fmt, uint16_t port, time_t now) {
+	char *p=buf;
+	if(fmt==out_json)
+		p=put_str(p, "[\n");
+	if(fmt==out_wgquick && port)
+		p=put_str(put_int(put_str(p, "[Interface]\nListenPort = "), port), "\n\n");
+	p+=render_records(p, recs, n, my_peer_id, fmt, now);
+	if(fmt==out_json)
+		p=put_str(p, (n ? "\n]\n" : "]\n"));
+	if(fmt==out_wgconf && port)
+		p=put_str(put_int(put_str(p, "[Interface]\nListenPort = "), port), "\n");
+	return(p-buf);
+}
+
+// write len bytes of buf to fd, with a single write(2) unless interrupted
+// returns 0, or -1 on error
+int write_all(int fd, char *buf, size_t len) {
+	while(len) {
+		ssize_t r=write(fd, buf, len);
+		if(r<0) return(-1);
+		buf+=r;
+		len-=r;
+	}
+	return(0);
+}
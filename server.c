@@ -0,0 +1,841 @@
+/* server.c - Request handling of the server for a NAT traversal and endpoint discovery protocol for Wireguard
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2022, Alexandre Janon <alex14fr@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <inttypes.h>
+#include "common.h"
+
+// peer_data is the database storage in memory, as an array of records
+// n_used is the number of records in use, peer_ptr the index of the next free (or oldest) slot in the array
+// db_gen is incremented at each modification of the database, slot_gen when a slot gets the record of another peer,
+// which moves records between the pages of the responses
+// ep_labels holds, for each record, the TAI64N label of the last update of its endpoint, which polls leave
+// unchanged, so that the replication does not take the endpoint of a refreshed record for a new one
+static unsigned char peer_data[max_peers*rec_size];
+static unsigned char ep_labels[max_peers*12];
+static unsigned int n_used=0, peer_ptr=0;
+static uint32_t db_gen=1, slot_gen=0;
+
+// hash index of the database on the Peer IDs: for each bucket, chain of the indices+1 of its records, ended by 0
+#define index_buckets 256
+static uint16_t index_head[index_buckets], index_next[max_peers];
+
+// requests of unknown peers waiting to be handled
+static struct request low_queue[low_queue_size];
+static int low_first=0, low_n=0;
+
+// under load, requests are only handled if they carry a cookie, proving that their source can receive
+// datagrams at its address: COOKIE is SipHash(cookie secret, address || port), and the other sources
+// are sent a cookie reply, smaller than their request, so that the server can't be used as a reflector
+// the cookie secret changes every cookie_period seconds, and the cookies of the previous one are still
+// accepted; cookies are required for cookie_hold seconds after a full batch, or always with cookies_always
+#define cookie_period 120
+#define cookie_hold 10
+static uint8_t cookie_secret[2][16];
+static time_t cookie_rotation=0, load_until=0;
+int cookie_policy=cookies_auto;
+
+// response datagrams are built when requested, and cached until the database is modified
+#define cache_slots 32
+struct resp_cache {
+	uint32_t gen, key;
+	uint16_t fmt, page, advice;
+	int len;
+	unsigned char buf[resp_max_size];
+};
+static struct resp_cache resp_cache[cache_slots];
+
+// poll interval advised to the clients asking for it, in seconds: at the end of each period of advice_period
+// seconds, it is doubled if the server was under load (it received full batches, as when cookies are required),
+// otherwise halved if endpoints changed, and otherwise brought halfway back to advice_base; subscribers are
+// advised to poll within their lease
+// the clients add their own jitter, so that the response datagrams can be cached
+#define advice_base 30
+#define advice_min 5
+#define advice_max 300
+#define advice_period 10
+static int poll_advice=advice_base, period_moves=0, period_loaded=0;
+static time_t advice_next=0;
+
+// subscriptions: for each record of the database, the address its peer subscribed from, until expiry, with the
+// fingerprint of the key of its request and whether it was an AEAD one; the records whose endpoint changed are queued,
+// and pushed to the subscribers in rounds of at most keep_peers records, which any client accepts in a single
+// datagram, with at most push_budget datagrams sent before the next batch of requests is received
+#define sub_lease 120
+#define push_budget 64
+struct subscription {
+	struct sockaddr_in addr;
+	time_t expiry;
+	uint64_t key;
+	int aead;
+};
+static struct subscription subs[max_peers];
+
+// fingerprint of the secret of a key, which unlike its serial survives the reloads of the keyring
+static uint64_t key_print(const struct group_key *key) {
+	uint64_t f;
+	memcpy(&f, key->enc_key, 8);
+	return(f);
+}
+static uint16_t push_queue[max_peers];
+static uint8_t push_queued[max_peers];
+static int push_n=0;
+// records of the current round, and index of the next subscription to send them to, or -1 between rounds
+static unsigned char push_recs[keep_peers*rec_size];
+static int push_count=0, push_next=-1;
+
+struct metrics metrics;
+
+// optional export of the database in shared memory
+struct shm_db *shm=NULL;
+
+// optional replication to the other nodes of a cluster
+int cluster_sock=-1;
+
+// optional whitelist of Peer IDs (SC2), and the Group secrets, replaced on SIGHUP by the reload thread
+struct whitelist *whitelist=NULL;
+struct keyring *keys=NULL;
+
+// when nonzero, the time used by the server instead of the clock, and responses are built but not sent
+time_t pinned_time=0;
+int server_dry_run=0;
+
+time_t server_time(void) {
+	return(pinned_time ? pinned_time : time(NULL));
+}
+
+// read the current and next Group secrets
+// a missing next secret is not an error: only the current one is used
+struct keyring *keyring_load(char *secret_file, char *next_secret_file) {
+	struct keyring *kr=malloc(sizeof(struct keyring));
+	if(!kr || load_key(&kr->k[0], secret_file)) {
+		free(kr);
+		return(NULL);
+	}
+	kr->n=1;
+	if(next_secret_file) {
+		if(load_key(&kr->k[1], next_secret_file))
+			printf("no next secret\n");
+		else if(memcmp(kr->k[0].secret, kr->k[1].secret, secret_size))
+			kr->n=2;
+	}
+	return(kr);
+}
+
+// dump the counters of the server
+void print_metrics(void) {
+	struct metrics m;
+	uint64_t *src=(uint64_t*)&metrics, *dst=(uint64_t*)&m;
+	for(int i=0;i<sizeof(struct metrics)/sizeof(uint64_t);i++)
+		dst[i]=__atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	printf("# requests %" PRIu64 " rejected %" PRIu64 " response datagrams %" PRIu64 "\n", m.requests, m.rejected, m.responses);
+	if(cluster_sock>=0) {
+		printf("# replication sent %" PRIu64 " received %" PRIu64 " rejected %" PRIu64 " applied %" PRIu64 "\n", m.repl_sent, m.repl_received, m.repl_rejected, m.repl_applied);
+		printf("# replication lag last %" PRIu64 " ms mean %" PRIu64 " ms max %" PRIu64 " ms\n", m.repl_lag_last, (m.repl_applied ? m.repl_lag_sum/m.repl_applied : 0), m.repl_lag_max);
+		printf("# anti-entropy rounds %" PRIu64 " records repaired %" PRIu64 "\n", m.ae_rounds, m.ae_repairs);
+	}
+	printf("# cookies %s, replies %" PRIu64 " dropped %" PRIu64 "\n", (m.cookie_mode ? "required" : "not required"), m.cookie_replies, m.cookie_dropped);
+	printf("# last batch known %" PRIu64 " queued unknown %" PRIu64 " (max %" PRIu64 ") shed %" PRIu64 "\n", m.queue_known, m.queue_unknown, m.queue_unknown_max, m.shed);
+	printf("# subscriptions %" PRIu64 " subscribers %" PRIu64 " push datagrams %" PRIu64 "\n", m.subscriptions, m.subscribers, m.pushes);
+	printf("# advised poll interval %" PRIu64 " s\n", m.poll_advice);
+#ifdef STAGE_STATS
+	print_stages();
+#endif
+	fflush(stdout);
+}
+
+// draw a new cookie secret when the current one is cookie_period seconds old, or both at startup
+void cookie_rotate(time_t now) {
+	if(now<cookie_rotation) return;
+	int first=!cookie_rotation;
+	memcpy(cookie_secret[1], cookie_secret[0], 16);
+	int fd=open("/dev/urandom", O_RDONLY);
+	if(fd<0 || read(fd, cookie_secret[0], 16)!=16 || (first && read(fd, cookie_secret[1], 16)!=16)) {
+		perror("/dev/urandom");
+		exit(1);
+	}
+	close(fd);
+	cookie_rotation=now+cookie_period;
+}
+
+// cookie of a source address with the cookie secret s
+void cookie_make(uint8_t out[cookie_size], int s, struct sockaddr_in *addr) {
+	uint8_t a[6];
+	memcpy(a, &addr->sin_addr, 4);
+	memcpy(a+4, &addr->sin_port, 2);
+	uint64_t c=siphash24(cookie_secret[s], a, 6);
+	memcpy(out, &c, cookie_size);
+}
+
+// remove the cookie trailer of a request, if any
+// returns 1 if it carried a valid cookie for its source address, 0 otherwise
+int cookie_check(struct request *rq) {
+	int len=rq->len-cookie_trailer_size;
+	if(len!=pkt_size+enc_overhead && !is_aead_request(len)) return(0);
+	uint8_t *t=rq->pkt+len;
+	uint32_t magic;
+	memcpy(&magic, t, 4);
+	if(ntohl(magic)!=cookie_magic) return(0);
+	rq->len=len;
+	for(int s=0;s<2;s++) {
+		uint8_t c[cookie_size], d=0;
+		cookie_make(c, s, &rq->addr);
+		for(int i=0;i<cookie_size;i++)
+			d|=c[i]^t[4+i];
+		if(!d) return(1);
+	}
+	return(0);
+}
+
+// write the cookie reply to a request to out
+void cookie_reply(uint8_t out[cookie_reply_size], struct request *rq) {
+	uint32_t magic=htonl(cookie_magic);
+	memcpy(out, &magic, 4);
+	cookie_make(out+4, 0, &rq->addr);
+	memcpy(out+4+cookie_size, rq->pkt+rq->len-8, 8);
+}
+
+// Peer IDs are public keys, uniformly distributed: their first bytes select the bucket
+static uint16_t *index_bucket(unsigned char *peer_id) {
+	uint32_t h;
+	memcpy(&h, peer_id, 4);
+	return(&index_head[h%index_buckets]);
+}
+
+// returns the index of the record of peer_id in the database, or -1 if it is not there
+int peer_find(unsigned char *peer_id) {
+	for(int i=*index_bucket(peer_id);i;i=index_next[i-1])
+		if(!memcmp(peer_data+(i-1)*rec_size, peer_id, peer_id_size))
+			return(i-1);
+	return(-1);
+}
+
+// remove the record at index from its chain, before it is given another Peer ID
+static void index_remove(int index) {
+	uint16_t *p=index_bucket(peer_data+index*rec_size);
+	while(*p && *p!=index+1)
+		p=&index_next[*p-1];
+	if(*p) *p=index_next[index];
+}
+
+// add the record at index to the chain of its Peer ID
+static void index_add(int index) {
+	uint16_t *head=index_bucket(peer_data+index*rec_size);
+	index_next[index]=*head;
+	*head=index+1;
+}
+
+// search if a peer ID is in the database
+// if so, out contains its record
+// if not, out is zeroed
+void peer_search(unsigned char peer_id[peer_id_size], unsigned char *out) {
+	int i=peer_find(peer_id);
+	if(i>=0)
+		memcpy(out, peer_data+i*rec_size, rec_size);
+	else
+		bzero(out, rec_size);
+}
+
+// copy the record at index to the shared memory object, counting the endpoint changes of the peer
+void shm_publish(int index, int moved, int new_peer) {
+	uint32_t seq=shm->seq;
+	__atomic_store_n(&shm->seq, seq+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(shm->recs+index*rec_size, peer_data+index*rec_size, rec_size);
+	shm->moves[index]=(new_peer ? 0 : shm->moves[index]+moved);
+	shm->n_used=n_used;
+	shm->updates++;
+	__atomic_store_n(&shm->seq, seq+2, __ATOMIC_RELEASE);
+}
+
+// update database record at index, log and invalidate cached responses
+void peer_replace_at(int index, unsigned char new_peer[rec_size], uint16_t update_endpoint) {
+	unsigned char *old=peer_data+index*rec_size;
+	int new_id=memcmp(old, new_peer, peer_id_size)!=0;
+	int moved=update_endpoint && !new_id && memcmp(old+addr_off, new_peer+addr_off, 6);
+	if(update_endpoint) {
+		// update the whole record
+		printf("update whole rec, index=%d\n",index);
+		if(new_id) index_remove(index);
+		memcpy(peer_data+index*rec_size, new_peer, rec_size);
+		memcpy(ep_labels+index*12, new_peer+counter_off, 12);
+		if(new_id) index_add(index);
+	} else {
+		// update TAI64N counter only
+		memcpy(peer_data+index*rec_size+38, new_peer+38, 12);
+	}
+	//if(update_endpoint) { printf("Endpoint updated\n"); }
+	//else { printf("Endpoint NOT updated\n"); }
+	print_record(peer_data+index*rec_size, NULL, 0, server_time());
+	db_gen++;
+	if(new_id) slot_gen++;
+	// the subscription of the previous peer of the slot ends, and the subscribers are told of a new endpoint
+	if(new_id) subs[index].expiry=0;
+	if(moved || new_id) period_moves++;
+	if((moved || new_id) && !push_queued[index]) {
+		push_queued[index]=1;
+		push_queue[push_n++]=index;
+	}
+	if(shm) shm_publish(index, moved, new_id);
+}
+
+// add new_peer record in the next free (or oldest) slot of the database
+// returns the record in the database
+unsigned char *peer_insert(unsigned char new_peer[rec_size]) {
+	int index=peer_ptr;
+	peer_ptr++;
+	if(peer_ptr>n_used) n_used=peer_ptr;
+	if(peer_ptr==max_peers) peer_ptr=0;
+	peer_replace_at(index, new_peer, 1);
+	return(peer_data+index*rec_size);
+}
+
+// update database by adding (or updating) new_peer record
+// returns the record in the database, or NULL if it was not added
+unsigned char *peer_replace(unsigned char new_peer[rec_size], uint16_t update_endpoint) {
+	int i=peer_find(new_peer);
+	if(i>=0) {
+		// peer already in database
+		peer_replace_at(i, new_peer, update_endpoint);
+		return(peer_data+i*rec_size);
+	}
+	// peer not in database, don't add to database if endpoint update not requested
+	if(update_endpoint)
+		return(peer_insert(new_peer));
+	return(NULL);
+}
+
+// merge a record replicated from another node of the cluster, with the label ep of the last update of its
+// endpoint: keep the endpoint with the largest ep, or the largest endpoint for equal ones, and the largest
+// TAI64N label, so that all the nodes keep the same record
+// a record of a new peer only replaces the least recently seen record of a full database, if it is more
+// recent, so that the nodes do not evict each other's records
+// returns 1 if the database was updated, 0 otherwise
+int peer_merge(unsigned char *rec, unsigned char *ep) {
+	int i=peer_find(rec);
+	if(i<0) {
+		unsigned char *slot;
+		if(n_used<max_peers)
+			slot=peer_insert(rec);
+		else {
+			int o=0;
+			for(int k=1;k<n_used;k++)
+				if(memcmp(peer_data+k*rec_size+counter_off, peer_data+o*rec_size+counter_off, 12)<0)
+					o=k;
+			if(memcmp(rec+counter_off, peer_data+o*rec_size+counter_off, 12)<=0) return(0);
+			peer_replace_at(o, rec, 1);
+			slot=peer_data+o*rec_size;
+		}
+		memcpy(peer_ep_label(slot), ep, 12);
+		return(1);
+	}
+	unsigned char *cur=peer_data+i*rec_size, merged[rec_size];
+	int e=memcmp(ep, ep_labels+i*12, 12);
+	int moved=(e>0 || (e==0 && memcmp(rec+addr_off, cur+addr_off, 6)>0));
+	int newer=memcmp(rec+counter_off, cur+counter_off, 12)>0;
+	if(!moved && !newer) return(0);
+	memcpy(merged, (moved ? rec : cur), rec_size);
+	memcpy(merged+counter_off, (newer ? rec : cur)+counter_off, 12);
+	peer_replace_at(i, merged, moved);
+	if(moved) memcpy(ep_labels+i*12, ep, 12);
+	return(1);
+}
+
+// label of the last endpoint update of a record of the database
+unsigned char *peer_ep_label(unsigned char *rec) {
+	return(ep_labels+(rec-peer_data)/rec_size*12);
+}
+
+// records in use in the database, and their number in n
+unsigned char *peer_db(unsigned int *n) {
+	*n=n_used;
+	return(peer_data);
+}
+
+// number of records in each response datagram of format fmt: compact datagrams are filled up
+// to the size given by the client, and carry at least as many records as the fixed-size ones
+int page_recs(uint16_t fmt) {
+	int size=((fmt&clflg_mtu_mask)>>clflg_mtu_shift)*100-(fmt&clflg_advice ? advice_size : 0);
+	if(!(fmt&clflg_compact) || size<=compact_size(keep_peers)+enc_overhead)
+		return(keep_peers);
+	if(size>max_datagram-advice_size) size=max_datagram-advice_size;
+	return((size-enc_overhead-compact_size(0))/rec_size);
+}
+
+// number of response datagrams of format fmt needed for the database
+// clients which know neither paged nor compact datagrams only read the first one, so they get the most recent records in one
+int n_pages(uint16_t fmt) {
+	if(!(fmt&(clflg_compact|clflg_paged))) return(1);
+	int per_page=page_recs(fmt);
+	return(n_used ? (n_used+per_page-1)/per_page : 1);
+}
+
+// copy the (at most) keep_peers records with the largest TAI64N labels to out, most recent first
+// returns their number
+static int recent_recs(unsigned char *out) {
+	int top[keep_peers], n=0;
+	for(int i=0;i<n_used;i++) {
+		unsigned char *label=peer_data+i*rec_size+counter_off;
+		int j=(n<keep_peers ? n++ : n);
+		for(;j>0 && memcmp(label, peer_data+top[j-1]*rec_size+counter_off, 12)>0;j--)
+			if(j<keep_peers) top[j]=top[j-1];
+		if(j<keep_peers) top[j]=i;
+	}
+	for(int j=0;j<n;j++)
+		memcpy(out+j*rec_size, peer_data+top[j]*rec_size, rec_size);
+	return(n);
+}
+
+// in the format of a response datagram, in place of the request bits of CLFLG: sealed as an AEAD payload, without HMAC
+#define fmt_aead 0x0001
+
+// response datagram carrying records page*page_recs(fmt)... of the database, with its HMAC by key, and its size in len
+// fmt is the CLFLG of the request, masked to the bits selecting the format of the response:
+// with clflg_compact, only the records in use are sent, after their count, in datagrams of the size given by clflg_mtu_mask,
+// with clflg_paged, the index of the datagram is given in the high byte of N_OTHER
+unsigned char *response_page(uint16_t fmt, int page, const struct group_key *key, int *len) {
+	struct resp_cache *c=&resp_cache[(((fmt>>2)+(fmt&fmt_aead)*64+(key->serial&1)*128)*max_pages+page)%cache_slots];
+	// ADVICE is only sent in compact datagrams
+	if(!(fmt&clflg_compact)) fmt&=~clflg_advice;
+	int advice=(fmt&clflg_subscribe && poll_advice>sub_lease*3/4 ? sub_lease*3/4 : poll_advice);
+	if(c->gen==db_gen && c->key==key->serial && c->fmt==fmt && c->page==page && (!(fmt&clflg_advice) || c->advice==advice)) {
+		*len=c->len;
+		return(c->buf);
+	}
+	int per_page=page_recs(fmt);
+	int first=page*per_page, n=(n_used-first<per_page ? n_used-first : per_page);
+	unsigned char *p=c->buf;
+	if(fmt&clflg_compact) {
+		uint16_t count=htons(n);
+		memcpy(p, &count, 2);
+		memcpy(p+2, peer_data+first*rec_size, n*rec_size);
+		p+=2+n*rec_size;
+	} else {
+		if(fmt&clflg_paged)
+			memcpy(p, peer_data+first*rec_size, n*rec_size);
+		else
+			n=recent_recs(p);
+		bzero(p+n*rec_size, (keep_peers-n)*rec_size);
+		p+=keep_peers*rec_size;
+	}
+	if(fmt&clflg_advice) {
+		uint16_t a=htons(advice);
+		memcpy(p, &a, advice_size);
+		p+=advice_size;
+	}
+	uint16_t svext=htons((fmt&(svext_compact|svext_paged|(fmt&clflg_compact ? svext_mtu_mask : 0)))|(aead_overhead ? svext_aead : 0)|(fmt&clflg_subscribe ? svext_subscribed : 0)|(fmt&clflg_advice ? svext_advice : 0));
+	uint16_t n_other=htons((n_pages(fmt)-1)|(fmt&clflg_paged ? page<<8 : 0));
+	// indexed datagrams carry the generation of the slots in place of GROUP
+	uint32_t gen=htonl(fmt&clflg_paged ? slot_gen : 0);
+	memcpy(p, &svext, 2);
+	memcpy(p+2, &n_other, 2);
+	memcpy(p+4, &gen, 4);
+	p+=8;
+	if(!(fmt&fmt_aead)) {
+		hmac_sha256_pre(p, c->buf, p-c->buf, &key->hctx);
+		p+=hmac_size;
+	}
+	c->gen=db_gen;
+	c->key=key->serial;
+	c->fmt=fmt;
+	c->page=page;
+	c->advice=advice;
+	c->len=*len=p-c->buf;
+	return(c->buf);
+}
+
+// response datagrams of the current batch, sent together when tx_batch of them are queued, and at the
+// end of the batch
+#define tx_batch 32
+static unsigned char tx_buf[tx_batch][resp_max_size+enc_overhead];
+static struct iovec tx_iov[tx_batch];
+static struct sockaddr_in tx_dst[tx_batch];
+static int tx_n=0;
+
+static void tx_flush(int sock) {
+	if(!tx_n) return;
+	stage_begin(st);
+	int sent=(server_dry_run ? tx_n : send_batch(sock, tx_iov, tx_dst, tx_n));
+	if(sent<0) perror("sendmmsg");
+	else metric_add(responses, sent);
+	tx_n=0;
+	stage_end(stage_send, st);
+}
+
+// send the response datagrams to a request: all of them, or the single one selected by CLFLG
+// they are signed with the key which authenticated the request, as AEAD payloads if it was one
+void send_response(int sock, uint16_t clflg, struct sockaddr_in *cl_addr, const struct group_key *key, int aead) {
+	uint16_t fmt=(clflg&(clflg_compact|clflg_paged|clflg_mtu_mask|clflg_subscribe|clflg_advice))|(aead ? fmt_aead : 0);
+	int sel=(clflg&clflg_page_mask)>>clflg_page_shift, n=n_pages(fmt);
+	for(int page=(sel ? sel-1 : 0); page<(sel ? sel : n) && page<n; page++) {
+		int len;
+		stage_begin(st);
+		unsigned char *buf=response_page(fmt,page,key,&len);
+		stage_end(stage_response, st);
+		if(tx_n==tx_batch) tx_flush(sock);
+		uint8_t *buf_enc=tx_buf[tx_n];
+		tx_iov[tx_n].iov_base=buf_enc;
+		tx_iov[tx_n].iov_len=(aead ? seal_aead(key,buf,len,buf_enc,0 /*group*/) : seal_payload(key,buf,len,buf_enc,0 /*group*/));
+		tx_dst[tx_n++]=*cl_addr;
+		stage_end(stage_encrypt, st);
+	}
+}
+
+// check whether packet is valid, and authenticated by key, unless it was already by the tag of its AEAD payload
+// only reads the whitelist and the key, so that requests can be checked in parallel: the TAI64N label is
+// compared to the one of the database by packet_fresh()
+// rejections are only logged if verbose
+// returns
+//  1 for accepted packet
+//  0 for rejected packet
+int packet_ok(unsigned char *inpacket, const struct group_key *key, int aead, int verbose) {
+		// check the whitelist first, as it is cheaper than the HMAC
+		struct whitelist *wl=__atomic_load_n(&whitelist, __ATOMIC_SEQ_CST);
+		if(wl && !whitelist_search(wl, inpacket)) {
+			if(verbose) printf("peer not in whitelist\n");
+			return(0);
+		}
+		uint64_t my_time=server_time();
+		uint64_t pkt_tai64;
+		memcpy(&pkt_tai64, inpacket+pkt_counter_off, 8);
+		pkt_tai64=be64toh(pkt_tai64);
+		// bit 62 of TAI64 must be set (timestamp presumably after Jan 1, 1970), bit 63 unset (bit 63 set is reserved)
+		if( (pkt_tai64&((uint64_t)1<<62))==0 || (pkt_tai64&((uint64_t)1<<63))!=0 ) { 
+			if(verbose) printf("bogus inpacket TAI64 : %" PRIx64 "\n", pkt_tai64);
+			return(0);
+		}
+		// reject packets too far in the past or in the future
+		uint64_t peer_sec=pkt_tai64&(~((uint64_t)1<<62));
+		if( (peer_sec > my_time+30) || (peer_sec < my_time-30) ) {
+			if(verbose) printf("large time difference peer_sec=%" PRIx64 " my_time=%" PRIx64 "\n", peer_sec, my_time);
+			return(0);
+		}
+		if(aead) return(1);
+		// compute and check HMAC
+		uint8_t my_hmac[32];
+		hmac_sha256_pre(my_hmac, inpacket, pkt_size-hmac_size, &key->hctx);
+		//for(int i=0;i<hmac_size;i++) printf("%x ",my_hmac[i]);printf("\n");
+		//for(int i=0;i<hmac_size;i++) printf("%x ",inpacket[pkt_hmac_off+i]);printf("\n");
+		if(str_nequ_ctime(my_hmac, inpacket+pkt_hmac_off)) {
+			if(verbose) printf("wrong hmac\n");
+			return(0);
+		}
+		return(1);
+}
+
+// for already known peers, check that the clock of an authenticated packet is strictly increasing
+// returns 1 if it is, or the peer is not known, 0 otherwise
+int packet_fresh(unsigned char *inpacket) {
+	uint8_t this_peer[rec_size];
+	peer_search(inpacket, this_peer);
+	for(int i=0;i<rec_size;i++) {
+		if(this_peer[i]) {
+			uint64_t my_time, peer_sec;
+			memcpy(&my_time, this_peer+counter_off, 8);
+			memcpy(&peer_sec, inpacket+pkt_counter_off, 8);
+			my_time=be64toh(my_time)&(~((uint64_t)1<<62));
+			peer_sec=be64toh(peer_sec)&(~((uint64_t)1<<62));
+			uint32_t my_ns, peer_ns;
+			memcpy(&my_ns, this_peer+counter_off+8, 4);
+			memcpy(&peer_ns, inpacket+pkt_counter_off+8, 4);
+			my_ns=be32toh(my_ns);
+			peer_ns=be32toh(peer_ns);
+			if( (peer_sec<my_time) || (peer_sec==my_time && peer_ns<=my_ns) ) {
+				printf("old inpacket\n");
+				return(0);
+			}
+			break;
+		}
+	}
+	return(1);
+}
+
+// number of requests recently authenticated by each key of the keyring, to try the most used one first,
+// and the keyring they count for, known by the serial of its first key and its number of keys (a reloaded
+// keyring may be allocated at the address of the previous one)
+static uint32_t hits_serial=0;
+static int hits_n=0;
+static uint32_t key_hits[2]={ 0, 0 };
+
+// index in kr of the key to try first
+int key_first(struct keyring *kr) {
+	if(kr->k[0].serial!=hits_serial || kr->n!=hits_n) {
+		hits_serial=kr->k[0].serial;
+		hits_n=kr->n;
+		key_hits[0]=key_hits[1]=0;
+	}
+	return(kr->n>1 && key_hits[1]>key_hits[0]);
+}
+
+// whether a request comes from a peer in the database, from its Peer ID decrypted with the key
+// to try first: a cheap test, before authenticating the request
+int request_known(struct keyring *kr, struct request *rq) {
+	unsigned char peer_id[peer_id_size];
+	if(open_payload(&kr->k[key_first(kr)], rq->pkt, rq->len, peer_id, peer_id_size, NULL)!=peer_id_size)
+		return(0);
+	return(peer_find(peer_id)>=0);
+}
+
+// decrypt and authenticate a request into inpacket, trying the keys of kr from the one of index first: the
+// stages which do not depend on the database, run by the verifier threads in pipelined mode
+// returns the index of the key, or -1 if the request is rejected
+int request_verify(struct keyring *kr, int first, struct request *rq, unsigned char *inpacket) {
+	stage_wait(&rq->ts);
+	stage_begin(st);
+	int aead=is_aead_request(rq->len), clear_size=(aead ? pkt_size-hmac_size : pkt_size);
+	for(int t=0;t<kr->n;t++) {
+		const struct group_key *k=&kr->k[(first+t)%kr->n];
+		int opened=((aead ? open_aead(k,rq->pkt,rq->len,inpacket,clear_size,NULL /*group*/) : open_payload(k,rq->pkt,rq->len,inpacket,pkt_size,NULL /*group*/))==clear_size);
+		stage_end(stage_decrypt, st);
+		int ok=(opened && packet_ok(inpacket,k,aead,t==kr->n-1));
+		stage_end(stage_auth, st);
+		if(ok) return((first+t)%kr->n);
+	}
+	return(-1);
+}
+
+// handle a request verified with the key of index i of kr (rejected if -1): check that its label is newer
+// than the one in the database, update the database and queue the response datagrams
+// returns 1 if the request was accepted, 0 otherwise
+int request_apply(int sock, struct keyring *kr, struct request *rq, unsigned char *inpacket, int i) {
+	stage_begin(st);
+	if(i<0 || !packet_fresh(inpacket)) {
+		metric_add(rejected, 1);
+		return(0);
+	}
+	metric_add(requests, 1);
+	const struct group_key *key=&kr->k[i];
+	int aead=is_aead_request(rq->len);
+	// decay the counts, to follow the clients switching to the next key
+	if(++key_hits[i]>=256) {
+		key_hits[0]>>=1;
+		key_hits[1]>>=1;
+	}
+	// create record associated with this request
+	uint16_t clflg=*(uint16_t*)(inpacket+pkt_clflg_off);
+	clflg=ntohs(clflg);
+	// illogical request, update endpoint without updating TAI64: force update of both
+	if(!(clflg&1)&&(clflg&2)) clflg&=~3;
+	if(!(clflg&1)||!(clflg&2)) { // if an update is requested
+		unsigned char this_peer[rec_size];
+		memcpy(this_peer, inpacket, peer_id_size);
+		if(!(clflg&1)) { // if endpoint update is requested
+			memcpy(this_peer+addr_off, &(rq->addr.sin_addr), 4);
+			*(uint32_t*)(this_peer+addr_off)^=ip_mask;
+			memcpy(this_peer+port_off, &(rq->addr.sin_port), 2);
+		}
+		memcpy(this_peer+counter_off, inpacket+peer_id_size, 12);
+		// insert record, and send it to the other nodes
+		unsigned char *rec=peer_replace(this_peer, !(clflg&1));
+		if(rec && cluster_sock>=0)
+			cluster_publish(rec);
+		stage_end(stage_update, st);
+	}
+	// subscribe the source of the request, if its peer is in the database
+	if(clflg&clflg_subscribe) {
+		int index=peer_find(inpacket);
+		if(index>=0) {
+			subs[index].addr=rq->addr;
+			subs[index].expiry=server_time()+sub_lease;
+			subs[index].key=key_print(key);
+			subs[index].aead=aead;
+			metric_add(subscriptions, 1);
+		} else
+			clflg&=~clflg_subscribe;
+	}
+	// send response datagrams
+	send_response(sock, clflg, &rq->addr, key, aead);
+	return(1);
+}
+
+// authenticate a request, update the database and queue the response datagrams
+// the keys are tried in decreasing order of recent use, so that the HMAC is usually computed once
+void handle_request(int sock, struct keyring *kr, struct request *rq) {
+	unsigned char inpacket[pkt_size];
+	stage_begin(start);
+	if(request_apply(sock, kr, rq, inpacket, request_verify(kr, key_first(kr), rq, inpacket)))
+		stage_end(stage_total, start);
+}
+
+// build the push datagram of the current round for key, in pkt: COUNT || RECORDS || SVEXT || N_OTHER || GROUP || HMAC,
+// the format of a compact response datagram, sealed as an AEAD payload (without HMAC) if aead
+// returns its size
+static int push_datagram(const struct group_key *key, int aead, unsigned char *pkt) {
+	unsigned char buf[compact_size(keep_peers)];
+	uint16_t count=htons(push_count);
+	memcpy(buf, &count, 2);
+	memcpy(buf+2, push_recs, push_count*rec_size);
+	unsigned char *p=buf+2+push_count*rec_size;
+	uint16_t svext=htons(svext_compact|svext_push|(aead_overhead ? svext_aead : 0));
+	memcpy(p, &svext, 2);
+	bzero(p+2, 6);
+	p+=8;
+	if(aead)
+		return(seal_aead(key, buf, p-buf, pkt, 0 /*group*/));
+	hmac_sha256_pre(p, buf, p-buf, &key->hctx);
+	return(seal_payload(key, buf, p+hmac_size-buf, pkt, 0 /*group*/));
+}
+
+// send the records whose endpoint changed to the subscribers, starting a new round if none is in progress,
+// sending at most push_budget datagrams, in batches of rx_batch
+// the datagrams of a round are sealed once for each key and AEAD choice of the subscribers
+void push_send(int sock, struct keyring *kr) {
+	if(push_next<0) {
+		if(!push_n) return;
+		push_count=(push_n<keep_peers ? push_n : keep_peers);
+		for(int i=0;i<push_count;i++) {
+			memcpy(push_recs+i*rec_size, peer_data+push_queue[i]*rec_size, rec_size);
+			push_queued[push_queue[i]]=0;
+		}
+		push_n-=push_count;
+		memmove(push_queue, push_queue+push_count, push_n*sizeof(uint16_t));
+		push_next=0;
+	}
+	static unsigned char pkt[4][compact_size(keep_peers)+enc_overhead];
+	static int subscribers;
+	int pkt_len[4]={ 0, 0, 0, 0 };
+	struct iovec iov[rx_batch];
+	struct sockaddr_in dst[rx_batch];
+	time_t now=server_time();
+	int n=0, queued=0, sent=0;
+	if(!push_next) subscribers=0;
+	for(;push_next<n_used && queued<push_budget;push_next++) {
+		struct subscription *sb=&subs[push_next];
+		if(sb->expiry<=now) continue;
+		subscribers++;
+		int k;
+		for(k=0;k<kr->n && key_print(&kr->k[k])!=sb->key;k++);
+		if(k==kr->n) continue;
+		int v=k*2+sb->aead;
+		if(!pkt_len[v])
+			pkt_len[v]=push_datagram(&kr->k[k], sb->aead, pkt[v]);
+		iov[n].iov_base=pkt[v];
+		iov[n].iov_len=pkt_len[v];
+		dst[n++]=sb->addr;
+		queued++;
+		if(n==rx_batch) {
+			int r=(server_dry_run ? n : send_batch(sock, iov, dst, n));
+			if(r>0) sent+=r;
+			n=0;
+		}
+	}
+	if(n) {
+		int r=(server_dry_run ? n : send_batch(sock, iov, dst, n));
+		if(r>0) sent+=r;
+	}
+	metric_add(pushes, sent);
+	if(push_next>=n_used) {
+		push_next=-1;
+		metric_set(subscribers, subscribers);
+	}
+}
+
+// update the advised poll interval at the end of each period
+void advice_update(time_t now) {
+	if(now<advice_next) return;
+	if(advice_next) {
+		if(period_loaded)
+			poll_advice=(poll_advice*2<advice_max ? poll_advice*2 : advice_max);
+		else if(period_moves)
+			poll_advice=(poll_advice/2>advice_min ? poll_advice/2 : advice_min);
+		else
+			poll_advice=(poll_advice+advice_base)/2;
+	}
+	period_moves=0;
+	period_loaded=0;
+	advice_next=now+advice_period;
+	metric_set(poll_advice, poll_advice);
+}
+
+// handle a batch of n received requests: under load, answer those without a valid cookie with a cookie
+// reply, handle those of known peers at once, then queued ones of unknown peers as long as the loop keeps up
+// the requests to handle are collected first, to be verified in parallel in pipelined mode, and their
+// responses are sent together
+void serve_batch(int sock, struct request *rx, int n) {
+	struct request *todo[rx_batch+low_queue_size];
+	uint8_t replies[rx_batch][cookie_reply_size];
+	struct iovec reply_iov[rx_batch];
+	struct sockaddr_in reply_dst[rx_batch];
+	time_t now=server_time();
+	if(n==rx_batch) {
+		load_until=now+cookie_hold;
+		period_loaded=1;
+	}
+	advice_update(now);
+	int cookies=(cookie_policy==cookies_always || (cookie_policy==cookies_auto && now<load_until)), n_replies=0;
+	metric_set(cookie_mode, cookies);
+	cookie_rotate(now);
+	struct keyring *kr=__atomic_load_n(&keys, __ATOMIC_SEQ_CST);
+	int handled=0;
+	for(int i=0;i<n;i++) {
+		if(!cookie_check(&rx[i]) && cookies) {
+			if(rx[i].len!=pkt_size+enc_overhead && !is_aead_request(rx[i].len)) {
+				metric_add(cookie_dropped, 1);
+				continue;
+			}
+			cookie_reply(replies[n_replies], &rx[i]);
+			reply_iov[n_replies].iov_base=replies[n_replies];
+			reply_iov[n_replies].iov_len=cookie_reply_size;
+			reply_dst[n_replies++]=rx[i].addr;
+			continue;
+		}
+		if(request_known(kr, &rx[i])) {
+			todo[handled++]=&rx[i];
+			continue;
+		}
+		if(low_n==low_queue_size) {
+			low_first=(low_first+1)%low_queue_size;
+			low_n--;
+			metric_add(shed, 1);
+		}
+		low_queue[(low_first+low_n++)%low_queue_size]=rx[i];
+	}
+	int sent;
+	if(n_replies && (sent=(server_dry_run ? n_replies : send_batch(sock, reply_iov, reply_dst, n_replies)))>0)
+		metric_add(cookie_replies, sent);
+	metric_set(queue_known, handled);
+	metric_set(queue_unknown, low_n);
+	if(low_n>metrics.queue_unknown_max) metric_set(queue_unknown_max, low_n);
+	for(int budget=(n==rx_batch ? rx_budget : low_queue_size);handled<budget && low_n;handled++,low_n--) {
+		todo[handled]=&low_queue[low_first];
+		low_first=(low_first+1)%low_queue_size;
+	}
+	if(verifiers)
+		pipeline_run(sock, kr, todo, handled);
+	else
+		for(int i=0;i<handled;i++)
+			handle_request(sock, kr, todo[i]);
+	tx_flush(sock);
+	push_send(sock, kr);
+}
+
+// number of requests waiting to be handled, or rounds of pushes waiting to be sent
+int server_pending(void) {
+	return(low_n+(push_next>=0 || push_n));
+}
@@ -0,0 +1,73 @@
+/* siphash.c - SipHash-2-4 for a NAT traversal and endpoint discovery protocol for Wireguard
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2022, Alexandre Janon <alex14fr@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "common.h"
+
+// SipHash-2-4 (Aumasson, Bernstein), a keyed hash of short inputs, used for the cookies of wgsigd
+
+#define rotl(x, b) (((x)<<(b))|((x)>>(64-(b))))
+#define sipround(v0, v1, v2, v3) do { \
+	v0+=v1; v1=rotl(v1,13); v1^=v0; v0=rotl(v0,32); \
+	v2+=v3; v3=rotl(v3,16); v3^=v2; \
+	v0+=v3; v3=rotl(v3,21); v3^=v0; \
+	v2+=v1; v1=rotl(v1,17); v1^=v2; v2=rotl(v2,32); \
+} while(0)
+
+static uint64_t load64le(const uint8_t *p) {
+	uint64_t x;
+	memcpy(&x, p, 8);
+	return(le64toh(x));
+}
+
+uint64_t siphash24(const uint8_t key[16], const uint8_t *data, size_t len) {
+	uint64_t k0=load64le(key), k1=load64le(key+8);
+	uint64_t v0=k0^0x736f6d6570736575ULL, v1=k1^0x646f72616e646f6dULL;
+	uint64_t v2=k0^0x6c7967656e657261ULL, v3=k1^0x7465646279746573ULL;
+	size_t i;
+	for(i=0;i+8<=len;i+=8) {
+		uint64_t m=load64le(data+i);
+		v3^=m;
+		sipround(v0, v1, v2, v3);
+		sipround(v0, v1, v2, v3);
+		v0^=m;
+	}
+	// last block: remaining bytes, and the length in the high byte
+	uint64_t b=(uint64_t)len<<56;
+	for(int j=0;i+j<len;j++)
+		b|=(uint64_t)data[i+j]<<(8*j);
+	v3^=b;
+	sipround(v0, v1, v2, v3);
+	sipround(v0, v1, v2, v3);
+	v0^=b;
+	v2^=0xff;
+	for(int r=0;r<4;r++)
+		sipround(v0, v1, v2, v3);
+	return(v0^v1^v2^v3);
+}
@@ -0,0 +1,118 @@
+/* stages.c - Latency histograms for a NAT traversal and endpoint discovery protocol for Wireguard
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2022, Alexandre Janon <alex14fr@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <inttypes.h>
+#include "common.h"
+
+#ifdef STAGE_STATS
+
+// time spent in each stage of the request handling, in log-linear histograms of hist_sub buckets per
+// power of two of nanoseconds (at most 12.5% wide), with the exact count, sum and maximum
+#define hist_bits 3
+#define hist_sub (1<<hist_bits)
+#define hist_buckets (64*hist_sub)
+
+struct histogram {
+	uint64_t n, sum, max;
+	uint64_t b[hist_buckets];
+};
+static struct histogram stages[n_stages];
+static const char *stage_names[n_stages]={ "queue", "decrypt", "auth", "update", "response", "encrypt", "send", "total" };
+
+static int hist_bucket(uint64_t v) {
+	if(v<hist_sub) return(v);
+	int e=63-__builtin_clzll(v);
+	return(((e-hist_bits+1)<<hist_bits)|((v>>(e-hist_bits))&(hist_sub-1)));
+}
+
+// smallest value of bucket i
+static uint64_t hist_value(int i) {
+	if(i<hist_sub) return(i);
+	int e=(i>>hist_bits)+hist_bits-1;
+	return((uint64_t)(hist_sub|(i&(hist_sub-1)))<<(e-hist_bits));
+}
+
+uint64_t stage_clock(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
+	return((uint64_t)tp.tv_sec*1000000000+tp.tv_nsec);
+}
+
+// atomic, as the verifier threads record the first stages
+void stage_record(int s, uint64_t ns) {
+	struct histogram *h=&stages[s];
+	__atomic_add_fetch(&h->n, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->sum, ns, __ATOMIC_RELAXED);
+	uint64_t max=__atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while(ns>max && !__atomic_compare_exchange_n(&h->max, &max, ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) ;
+	__atomic_add_fetch(&h->b[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+}
+
+// record the time elapsed since *t in stage s, and start the next stage
+void stage_add(int s, uint64_t *t) {
+	uint64_t now=stage_clock();
+	stage_record(s, now-*t);
+	*t=now;
+}
+
+// record the time a request waited since the kernel received it, if known
+void stage_queued(struct timespec *ts) {
+	if(!ts->tv_sec) return;
+	struct timespec tp;
+	clock_gettime(CLOCK_REALTIME, &tp);
+	int64_t ns=(int64_t)(tp.tv_sec-ts->tv_sec)*1000000000+(tp.tv_nsec-ts->tv_nsec);
+	stage_record(stage_queue, (ns>0 ? ns : 0));
+}
+
+// upper bound of the fraction q of the samples of h, in us
+static double hist_quantile(struct histogram *h, uint64_t n, double q) {
+	uint64_t c=0, v=h->max;
+	for(int i=0;i<hist_buckets;i++)
+		if((c+=h->b[i])>n*q) {
+			v=hist_value(i+1);
+			break;
+		}
+	return((v<h->max ? v : h->max)/1000.);
+}
+
+// dump the histograms of the stages
+void print_stages(void) {
+	for(int s=0;s<n_stages;s++) {
+		struct histogram h;
+		memcpy(&h, &stages[s], sizeof(struct histogram));
+		uint64_t n=0;
+		for(int i=0;i<hist_buckets;i++)
+			n+=h.b[i];
+		if(!n) continue;
+		printf("# stage %-8s n %" PRIu64 " mean %.2f us p50 %.2f us p90 %.2f us p99 %.2f us max %.2f us\n", stage_names[s], n, h.sum/1000./h.n, hist_quantile(&h, n, 0.5), hist_quantile(&h, n, 0.9), hist_quantile(&h, n, 0.99), h.max/1000.);
+	}
+}
+
+#endif /* STAGE_STATS */
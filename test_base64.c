@@ -0,0 +1,115 @@
+/* test_base64 - bulk conversion of keys to and from base64, against the scalar functions
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2022, Alexandre Janon <alex14fr@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// build with each conversion of the keys, and run each build:
+// cc -o test_base64 test_base64.c base64.c
+// cc -mssse3 -o test_base64 test_base64.c base64.c
+// cc -mavx2 -o test_base64 test_base64.c base64.c
+
+#include "common.h"
+
+#define n_keys 4096
+#define stride 47
+
+static const char alphabet[]="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static int failed=0;
+
+static void result(const char *what, int bad) {
+	printf("%s %s\n", (bad ? "FAIL" : "ok  "), what);
+	if(bad) failed=1;
+}
+
+// whether c may be the character at position p of the encoding of a key
+static int valid_at(int p, int c) {
+	const char *a=(c ? strchr(alphabet, c) : NULL);
+	if(p==43) return(c=='=');
+	if(!a) return(0);
+	// the last character encodes 4 bits
+	return(p<42 || ((a-alphabet)&3)==0);
+}
+
+int main(void) {
+#if defined(__AVX2__)
+	printf("keys converted with AVX2\n");
+#elif defined(__SSSE3__)
+	printf("keys converted with SSSE3\n");
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	printf("keys converted with NEON\n");
+#else
+	printf("keys converted with the tables\n");
+#endif
+	static unsigned char keys[n_keys*32], dec[n_keys*32], enc[n_keys*stride];
+	unsigned char ref[45], bytes[33];
+	srandom(1);
+	for(int i=0;i<n_keys*32;i++)
+		keys[i]=random();
+	memset(keys, 0, 32);
+	memset(keys+32, 0xff, 32);
+
+	// encoding and decoding match the scalar functions
+	base64_encode_keys(keys, n_keys, enc, stride);
+	int bad=0;
+	for(int k=0;k<n_keys;k++) {
+		base64_encode(keys+k*32, 32, ref);
+		if(strcmp((char*)enc+k*stride, (char*)ref)) bad++;
+	}
+	result("base64_encode_keys matches base64_encode", bad);
+	bad=(base64_decode_keys(enc, stride, n_keys, dec)!=n_keys || memcmp(dec, keys, sizeof(keys)));
+	for(int k=0;k<n_keys;k++) {
+		base64_decode(enc+k*stride, 44, bytes);
+		if(memcmp(bytes, keys+k*32, 32)) bad++;
+	}
+	result("base64_decode_keys matches base64_decode", bad);
+
+	// every character replaced with every byte: only the canonical encodings are accepted
+	bad=0;
+	for(int k=0;k<64;k++) {
+		unsigned char s[44];
+		for(int p=0;p<44;p++)
+			for(int c=0;c<256;c++) {
+				memcpy(s, enc+k*stride, 44);
+				s[p]=c;
+				int ok=(base64_decode_keys(s, 44, 1, bytes)==1);
+				if(ok!=valid_at(p, c)) bad++;
+				else if(ok) {
+					base64_decode(s, 44, ref);
+					if(memcmp(bytes, ref, 32)) bad++;
+				}
+			}
+	}
+	result("base64_decode_keys rejects non-alphabet bytes, misplaced '=' and non-canonical final bits", bad);
+
+	// the index of the first invalid key is returned, after the keys before it were decoded
+	memset(dec, 0, 8*32);
+	enc[5*stride+20]='*';
+	bad=(base64_decode_keys(enc, stride, 8, dec)!=5 || memcmp(dec, keys, 5*32));
+	result("base64_decode_keys returns the index of the first invalid key", bad);
+	return(failed);
+}
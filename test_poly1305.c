@@ -0,0 +1,154 @@
+/* test_poly1305 - RFC 8439 Poly1305 2.5.2 and ChaCha20-Poly1305 AEAD 2.8.2 test vectors, and the AEAD payloads
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2022, Alexandre Janon <alex14fr@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// build with the 44-bit limbs, then the 26-bit ones:
+// cc -DENC_PAYLOAD -DHAS_GETRANDOM -o test_poly1305 test_poly1305.c poly1305.c enc_payload.c
+// cc -DENC_PAYLOAD -DHAS_GETRANDOM -U__SIZEOF_INT128__ -o test_poly1305 test_poly1305.c poly1305.c enc_payload.c
+
+#include "common.h"
+#include "chacha20.h"
+
+static int failed=0;
+
+static void check(const char *what, const uint8_t *got, const uint8_t *expected, int n) {
+	int ok=!memcmp(got, expected, n);
+	printf("%s %s\n", (ok ? "ok  " : "FAIL"), what);
+	if(!ok) failed=1;
+}
+
+// RFC 8439 2.8 ChaCha20-Poly1305 of the n bytes of m, with aad_len bytes of associated data, into c and tag
+static void rfc_aead(const uint8_t key[32], const uint8_t nonce[12], const uint8_t *aad, int aad_len, const uint8_t *m, int n, uint8_t *c, uint8_t tag[16]) {
+	uint8_t block0[64], zeros[16], lens[16];
+	chacha_ctx chctx;
+	poly1305_ctx p;
+	bzero(block0, 64);
+	bzero(zeros, 16);
+	chacha_keysetup(&chctx, key);
+	chacha_ivsetup(&chctx, nonce, 0);
+	chacha_encrypt_bytes(&chctx, block0, block0, 64);
+	chacha_ivsetup(&chctx, nonce, 1);
+	chacha_encrypt_bytes(&chctx, m, c, n);
+	poly1305_init(&p, block0);
+	poly1305_update(&p, aad, aad_len);
+	poly1305_update(&p, zeros, (16-aad_len%16)%16);
+	poly1305_update(&p, c, n);
+	poly1305_update(&p, zeros, (16-n%16)%16);
+	for(int i=0;i<8;i++) {
+		lens[i]=(uint64_t)aad_len>>(8*i);
+		lens[8+i]=(uint64_t)n>>(8*i);
+	}
+	poly1305_update(&p, lens, 16);
+	poly1305_finish(&p, tag);
+}
+
+int main(void) {
+#ifdef __SIZEOF_INT128__
+	printf("poly1305 with 44-bit limbs\n");
+#else
+	printf("poly1305 with 26-bit limbs\n");
+#endif
+	// 2.5.2 Poly1305, in one call and in uneven pieces
+	uint8_t pkey[32]={0x85,0xd6,0xbe,0x78,0x57,0x55,0x6d,0x33,0x7f,0x44,0x52,0xfe,0x42,0xd5,0x06,0xa8,0x01,0x03,0x80,0x8a,0xfb,0x0d,0xb2,0xfd,0x4a,0xbf,0xf6,0xaf,0x41,0x49,0xf5,0x1b};
+	uint8_t pmsg[]="Cryptographic Forum Research Group";
+	uint8_t ptag[16]={0xa8,0x06,0x1d,0xc1,0x30,0x51,0x36,0xc6,0xc2,0x2b,0x8b,0xaf,0x0c,0x01,0x27,0xa9};
+	uint8_t tag[16];
+	poly1305_ctx p;
+	poly1305_init(&p, pkey);
+	poly1305_update(&p, pmsg, 34);
+	poly1305_finish(&p, tag);
+	check("poly1305 2.5.2", tag, ptag, 16);
+	poly1305_init(&p, pkey);
+	poly1305_update(&p, pmsg, 5);
+	poly1305_update(&p, pmsg+5, 0);
+	poly1305_update(&p, pmsg+5, 17);
+	poly1305_update(&p, pmsg+22, 12);
+	poly1305_finish(&p, tag);
+	check("poly1305 2.5.2 in pieces", tag, ptag, 16);
+
+	// 2.8.2 ChaCha20-Poly1305
+	uint8_t key[32], nonce[12]={0x07,0x00,0x00,0x00,0x40,0x41,0x42,0x43,0x44,0x45,0x46,0x47};
+	uint8_t aad[12]={0x50,0x51,0x52,0x53,0xc0,0xc1,0xc2,0xc3,0xc4,0xc5,0xc6,0xc7};
+	for(int i=0;i<32;i++) key[i]=0x80+i;
+	uint8_t m[]="Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+	uint8_t ct[114]={
+		0xd3,0x1a,0x8d,0x34,0x64,0x8e,0x60,0xdb,0x7b,0x86,0xaf,0xbc,0x53,0xef,0x7e,0xc2,
+		0xa4,0xad,0xed,0x51,0x29,0x6e,0x08,0xfe,0xa9,0xe2,0xb5,0xa7,0x36,0xee,0x62,0xd6,
+		0x3d,0xbe,0xa4,0x5e,0x8c,0xa9,0x67,0x12,0x82,0xfa,0xfb,0x69,0xda,0x92,0x72,0x8b,
+		0x1a,0x71,0xde,0x0a,0x9e,0x06,0x0b,0x29,0x05,0xd6,0xa5,0xb6,0x7e,0xcd,0x3b,0x36,
+		0x92,0xdd,0xbd,0x7f,0x2d,0x77,0x8b,0x8c,0x98,0x03,0xae,0xe3,0x28,0x09,0x1b,0x58,
+		0xfa,0xb3,0x24,0xe4,0xfa,0xd6,0x75,0x94,0x55,0x85,0x80,0x8b,0x48,0x31,0xd7,0xbc,
+		0x3f,0xf4,0xde,0xf0,0x8e,0x4b,0x7a,0x9d,0xe5,0x76,0xd2,0x65,0x86,0xce,0xc6,0x4b,
+		0x61,0x16};
+	uint8_t atag[16]={0x1a,0xe1,0x0b,0x59,0x4f,0x09,0xe2,0x6a,0x7e,0x90,0x2e,0xcb,0xd0,0x60,0x06,0x91};
+	uint8_t c[114];
+	rfc_aead(key, nonce, aad, 12, m, 114, c, tag);
+	check("chacha20-poly1305 2.8.2 ciphertext", c, ct, 114);
+	check("chacha20-poly1305 2.8.2 tag", tag, atag, 16);
+
+	// AEAD payloads: SGROUP || NONCE || ciphertext || TAG, with SGROUP || NONCE as associated data
+	struct group_key gk;
+	bzero(&gk, sizeof(gk));
+	memcpy(gk.enc_key, key, 32);
+	uint8_t pkt[16+114+16], clear[114];
+	memcpy(pkt, aad, 4);
+	memcpy(pkt+4, nonce, 12);
+	rfc_aead(key, pkt+4, pkt, 16, m, 114, pkt+16, pkt+16+114);
+	int n=open_aead(&gk, pkt, sizeof(pkt), clear, sizeof(clear), NULL);
+	check("open_aead of a reference payload", clear, m, (n==114 ? 114 : 0));
+	if(n!=114) failed=1;
+	pkt[16+114+15]^=1;
+	n=open_aead(&gk, pkt, sizeof(pkt), clear, sizeof(clear), NULL);
+	printf("%s open_aead rejects a tampered tag\n", (n<0 ? "ok  " : "FAIL"));
+	if(n>=0) failed=1;
+	pkt[16+114+15]^=1;
+	pkt[16+50]^=0x80;
+	n=open_aead(&gk, pkt, sizeof(pkt), clear, sizeof(clear), NULL);
+	printf("%s open_aead rejects a tampered ciphertext\n", (n<0 ? "ok  " : "FAIL"));
+	if(n>=0) failed=1;
+	pkt[16+50]^=0x80;
+	pkt[2]^=1;
+	n=open_aead(&gk, pkt, sizeof(pkt), clear, sizeof(clear), NULL);
+	printf("%s open_aead rejects a tampered SGROUP\n", (n<0 ? "ok  " : "FAIL"));
+	if(n>=0) failed=1;
+
+	// seal_aead matches the reference construction, for all the sizes around the block boundaries
+	int bad=0;
+	for(int len=0;len<=114;len++) {
+		uint8_t sealed[16+114+16], ref[114+16];
+		n=seal_aead(&gk, m, len, sealed, 0x12345678);
+		rfc_aead(key, sealed+4, sealed, 16, m, len, ref, ref+len);
+		uint32_t group=0;
+		if(n!=len+32 || memcmp(sealed+16, ref, len+16) || open_aead(&gk, sealed, n, clear, sizeof(clear), &group)!=len || memcmp(clear, m, len) || group!=0x12345678)
+			bad++;
+	}
+	printf("%s seal_aead and open_aead of 0..114 bytes\n", (bad ? "FAIL" : "ok  "));
+	if(bad) failed=1;
+	return(failed);
+}
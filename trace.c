@@ -0,0 +1,95 @@
+/* trace.c - Request traces for a NAT traversal and endpoint discovery protocol for Wireguard
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2022, Alexandre Janon <alex14fr@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "common.h"
+
+// a trace is MAGIC(4), followed by a record for each received datagram:
+// TIME(8, ns since the Epoch) || ADDR(4) || PORT(2) || LEN(2) || DATAGRAM(LEN), all in network byte order
+
+// create a trace file
+// returns the file, or NULL on error
+FILE *trace_create(char *name) {
+	FILE *f=fopen(name, "wb");
+	if(!f) return(NULL);
+	setvbuf(f, NULL, _IOFBF, 65536);
+	uint32_t magic=htonl(trace_magic);
+	fwrite(&magic, 4, 1, f);
+	return(f);
+}
+
+// append n requests received at time ns to a trace
+void trace_write(FILE *f, struct request *rx, int n, uint64_t ns) {
+	uint64_t t=htobe64(ns);
+	for(int i=0;i<n;i++) {
+		uint8_t hdr[trace_hdr_size];
+		uint16_t len=htons(rx[i].len);
+		memcpy(hdr, &t, 8);
+		memcpy(hdr+8, &rx[i].addr.sin_addr, 4);
+		memcpy(hdr+12, &rx[i].addr.sin_port, 2);
+		memcpy(hdr+14, &len, 2);
+		fwrite(hdr, trace_hdr_size, 1, f);
+		fwrite(rx[i].pkt, rx[i].len, 1, f);
+	}
+}
+
+// open a trace file
+// returns the file, or NULL if it is not a trace
+FILE *trace_open(char *name) {
+	FILE *f=fopen(name, "rb");
+	uint32_t magic;
+	if(!f) return(NULL);
+	if(fread(&magic, 4, 1, f)!=1 || ntohl(magic)!=trace_magic) {
+		fclose(f);
+		return(NULL);
+	}
+	return(f);
+}
+
+// read the next request of a trace in rq, and the time it was received in ns
+// returns 1 if a request was read, 0 at the end of the trace, -1 if the trace is truncated or corrupted
+int trace_read(FILE *f, struct request *rq, uint64_t *ns) {
+	uint8_t hdr[trace_hdr_size];
+	size_t r=fread(hdr, 1, trace_hdr_size, f);
+	if(r==0) return(0);
+	if(r!=trace_hdr_size) return(-1);
+	uint64_t t;
+	uint16_t len;
+	memcpy(&t, hdr, 8);
+	memcpy(&len, hdr+14, 2);
+	*ns=be64toh(t);
+	rq->len=ntohs(len);
+	if(rq->len>sizeof(rq->pkt) || fread(rq->pkt, 1, rq->len, f)!=rq->len) return(-1);
+	bzero(&rq->ts, sizeof(struct timespec));
+	bzero(&rq->addr, sizeof(struct sockaddr_in));
+	rq->addr.sin_family=AF_INET;
+	memcpy(&rq->addr.sin_addr, hdr+8, 4);
+	memcpy(&rq->addr.sin_port, hdr+12, 2);
+	return(1);
+}
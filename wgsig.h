@@ -0,0 +1,114 @@
+/* wgsig.h - Client library for a NAT traversal and endpoint discovery protocol for Wireguard
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2022, Alexandre Janon <alex14fr@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// libwgsig: the client side of the protocol, without I/O
+//
+// requests are built into buffers of the caller, who sends them and feeds the datagrams it receives
+// to the session, which verifies them and collects the peer records of the response
+// the state of the sessions is in the structures of the caller: no allocation, no signal, and the only
+// shared variable is the counter numbering the keys, which key_init updates atomically, so that any
+// number of sessions can be used concurrently (the group_key defined along with it is left to the programs)
+
+#include "common.h"
+
+// cookie given by a server under load, for requests sent from one local port, and the end of the
+// last request sent to it, echoed by its cookie replies; and whether the server accepts AEAD requests,
+// learned from its responses
+struct wgsig_cookie {
+	unsigned char trailer[cookie_trailer_size];
+	unsigned char echo[8];
+	int valid;
+	int aead;
+};
+
+// a set of peer records
+struct wgsig_view {
+	int n;
+	unsigned char recs[max_peers*rec_size];
+};
+
+// a client identity, and the response it is receiving: number of datagrams and bitmap of those received,
+// generation of the slots of the database they come from, and number of times the response was collected
+// again because it changed, whether it confirmed a subscription, and the poll interval advised by the server
+// in seconds (0 if none); and the records of the last push datagram received
+struct wgsig_session {
+	struct group_key key;
+	unsigned char peer_id[peer_id_size];
+	uint16_t fmt;
+	int n_pages;
+	uint16_t received;
+	uint32_t gen;
+	int restarts;
+	int subscribed;
+	int advice;
+	struct wgsig_view view;
+	struct wgsig_view push;
+};
+
+// a peer record
+struct wgsig_peer {
+	unsigned char public_key[peer_id_size];
+	struct sockaddr_in endpoint;
+	// TAI64N label of its last request, as UNIX time
+	uint64_t seen;
+	uint32_t seen_ns;
+	// the record of the client itself
+	int self;
+};
+
+// requests: update the endpoint and the label of the client in the server database, only its label,
+// or neither
+#define wgsig_register 0
+#define wgsig_poll 1
+#define wgsig_fetch 3
+// ORed with the mode of a request: subscribe its source address to the pushes of the server, for a lease of
+// a few minutes, renewed by each request; the server then sends it the records whose endpoint changed
+#define wgsig_subscribe clflg_subscribe
+// largest request datagram
+#define wgsig_request_max (pkt_size+enc_overhead+cookie_trailer_size)
+// largest datagram a server sends
+#define wgsig_response_max (resp_max_size+enc_overhead)
+
+// results of wgsig_input
+#define wgsig_in_bad_hmac -2
+#define wgsig_in_invalid -1
+#define wgsig_in_duplicate 0
+#define wgsig_in_partial 1
+#define wgsig_in_complete 2
+#define wgsig_in_cookie 3
+#define wgsig_in_push 4
+
+extern void wgsig_init(struct wgsig_session *s, const unsigned char secret[secret_size], const unsigned char peer_id[peer_id_size], unsigned int max_size);
+extern void wgsig_start(struct wgsig_session *s);
+extern int wgsig_request(struct wgsig_session *s, int mode, int page, struct wgsig_cookie *c, unsigned char *buf, size_t size);
+extern int wgsig_input(struct wgsig_session *s, struct wgsig_cookie *c, const unsigned char *pkt, size_t len);
+extern uint16_t wgsig_missing(struct wgsig_session *s);
+extern int wgsig_peers(struct wgsig_session *s, int first, struct wgsig_peer *out, int max);
+extern int wgsig_merge(struct wgsig_view *v, const struct wgsig_view *delta);
@@ -28,130 +28,964 @@
  *
  */
 
-#include "common.h"
+#include "wgsig.h"
 #include <netdb.h>
-#include <signal.h>
+#include <poll.h>
+#include <errno.h>
 
-void alarm_handler(int x) {
-	printf("Timed out\n");
-	exit(2);
+#define max_servers 32
+
+// a signalling server, with its address resolved at most every resolve_ttl seconds
+// and its round-trip time estimated from the exchanges (in microseconds)
+struct server {
+	char *host;
+	uint16_t port;
+	struct sockaddr_in addr;
+	time_t expiry;
+	int64_t srtt, rttvar;
+	// consecutive exchanges in which this server was sent a request but did not answer first
+	unsigned int fails;
+	// state of the current exchange: time of the last request sent, and number of requests sent
+	int64_t sent_at, rtt;
+	unsigned int sends;
+	// cookies received from this server for the even and the odd local port
+	struct wgsig_cookie cookie[2];
+};
+
+// client state, kept across polls in daemon mode, and response of the last exchange
+static unsigned char my_id[peer_id_size];
+static struct wgsig_session session;
+static struct server servers[max_servers];
+static int n_servers=0;
+static uint16_t local_port;
+static unsigned int resolve_ttl=300;
+// whether the polls of the daemon subscribe the polling port to the pushes of the servers
+static uint8_t subscribe=0;
+// last peer set written to output, optionally cached in a file between runs
+static struct wgsig_view last_view;
+static uint8_t last_view_ok=0;
+static char *view_cache=NULL;
+// interface name when writing wg(8) commands instead of a configuration skeleton
+static char *wg_ifname=NULL;
+// output format, and whether the records of the response datagrams are written as soon as they are received
+static int out_format=out_wgconf;
+static uint8_t stream_output=0;
+static char out_buf[render_size(max_peers)];
+// largest response datagram accepted, in bytes
+static unsigned int max_size=1400;
+// number of bursts of pings sent to the peers, and time during which keepalives are sent after them
+static unsigned int punch_rounds=4;
+static unsigned int punch_hold=0;
+#define keepalive_period 15
+#define keepalive_rate 50
+
+// statistics of the last exchange
+static unsigned int last_attempts;
+static int64_t last_elapsed;
+
+static int64_t mono_us(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC,&tp);
+	return((int64_t)tp.tv_sec*1000000+tp.tv_nsec/1000);
 }
 
-int main(int argc, char **argv) {
-	if(argc<6) {
-		printf("Usage : %s <remote_host> <remote_port> <base64_peerid> <secret_file> <local_port>\n<local_port> is even to request to update server's endpoint information\n", argv[0]);
-		exit(6);
-	}
-	if(strlen(argv[3])!=44) {
-		printf("peerid must be 44 chars long\n");
-		exit(6);
+static time_t mono_time(void) {
+	return(mono_us()/1000000);
+}
+
+// parse a comma-separated list of host[:port] into servers
+void parse_servers(char *list, uint16_t default_port) {
+	char *tok;
+	for(tok=strtok(list, ","); tok && n_servers<max_servers; tok=strtok(NULL, ",")) {
+		struct server *sv=&servers[n_servers++];
+		bzero(sv, sizeof(struct server));
+		sv->host=tok;
+		sv->port=default_port;
+		char *colon=strchr(tok, ':');
+		if(colon) {
+			*colon=0;
+			sv->port=atoi(colon+1);
+		}
 	}
-	// read Group secret from supplied file
-	read_secret(argv[4]);
-	// base64-decode Peer ID
-	unsigned char my_id[32];
-	base64_decode((unsigned char*)argv[3],44,my_id);
-	struct addrinfo *ai, *ai_first=NULL;
-	// prepare connection to remote server
-	unsigned int sock=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	struct sockaddr_in laddr;
-	bzero(&laddr, sizeof(struct sockaddr_in));
-	laddr.sin_family=AF_INET;
-	laddr.sin_port=htons(atoi(argv[5]));
-	laddr.sin_addr.s_addr=INADDR_ANY;
-	if(bind(sock,(struct sockaddr*)&laddr,sizeof(struct sockaddr_in))) {
-		perror("bind");
-		exit(1);
-	}
-	// install timeout signal handler
-	struct sigaction sa;
-	bzero(&sa, sizeof(struct sigaction));
-	sa.sa_handler=alarm_handler;
-	sigaction(SIGALRM, &sa, NULL);
-	alarm(30);
-	// resolve remote hostname
-	struct addrinfo hints;
+}
+
+// resolve a server hostname, unless the address resolved previously is less than resolve_ttl seconds old
+// returns 0 when the server has a usable address, -1 otherwise
+int resolve_server(struct server *sv) {
+	time_t now=mono_time();
+	if(sv->expiry && now<sv->expiry) return(0);
+	struct addrinfo hints, *ai, *ai_first=NULL;
 	bzero(&hints,sizeof(struct addrinfo));
 	hints.ai_family=AF_INET;
 	hints.ai_socktype=SOCK_DGRAM;
 	hints.ai_protocol=IPPROTO_UDP;
-	getaddrinfo(argv[1],NULL,&hints,&ai_first);
+	getaddrinfo(sv->host,NULL,&hints,&ai_first);
 	for(ai=ai_first ; ai && ai->ai_family!=AF_INET ; ai=ai->ai_next ) ;
 	if(!ai) {
-		printf("%s : host not found\n", argv[1]);
-		exit(3);
+		printf("%s : host not found\n", sv->host);
+		if(ai_first) freeaddrinfo(ai_first);
+		// keep using the previous address, if any
+		return(sv->expiry ? 0 : -1);
 	}
 	// fill destination address
-	struct sockaddr_in saddr;
-	memcpy(&saddr, ai->ai_addr, sizeof(struct sockaddr_in));
-	saddr.sin_port=htons(atoi(argv[2]));
-	if(ai_first) {
-		freeaddrinfo(ai_first);
-		ai_first=NULL;
-	}
-	// prepare request datagram
-	uint8_t outpacket[pkt_size];
-	bzero(outpacket, pkt_size);
-	memcpy(outpacket, my_id, 32); 
-	struct timespec tp;
-	clock_gettime(CLOCK_REALTIME,&tp);
-	// TAI64 generation: we set the 62nd bit and convert endianness
-	uint64_t tai64=htobe64(tp.tv_sec|((uint64_t)1<<62));
-	uint32_t tns=htobe32((uint32_t)tp.tv_nsec);
-	*(uint64_t*)(outpacket+pkt_counter_off)=tai64;
-	*(uint32_t*)(outpacket+pkt_counter_off+8)=tns; 
-	// set CLFLG for odd-numbered local ports
-	if(atoi(argv[5]) % 2 == 1) {
-		uint16_t clflg=htons(1);
-		*(uint16_t*)(outpacket+pkt_clflg_off)=clflg;
-	}
-	// compute HMAC
-	hmac_sha256(outpacket+pkt_hmac_off, outpacket, pkt_size-hmac_size, secret, secret_size);
-	//for(int i=0;i<pkt_size;i++) { printf("%x ",outpacket[i]); } printf("\n");
-	// send request datagram
-	if(sendto_clear(sock,outpacket,pkt_size,(struct sockaddr*)&saddr,sizeof(struct sockaddr_in),0/*group*/)<0) {
+	memcpy(&sv->addr, ai->ai_addr, sizeof(struct sockaddr_in));
+	sv->addr.sin_port=htons(sv->port);
+	freeaddrinfo(ai_first);
+	sv->expiry=now+resolve_ttl;
+	return(0);
+}
+
+// open an UDP socket bound to port
+// returns the socket, or -1
+int open_socket(uint16_t port) {
+	int sock=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if(sock<0) {
+		perror("socket");
+		return(-1);
+	}
+	struct sockaddr_in laddr;
+	bzero(&laddr, sizeof(struct sockaddr_in));
+	laddr.sin_family=AF_INET;
+	laddr.sin_port=htons(port);
+	laddr.sin_addr.s_addr=INADDR_ANY;
+	if(bind(sock,(struct sockaddr*)&laddr,sizeof(struct sockaddr_in))) {
+		perror("bind");
+		close(sock);
+		return(-1);
+	}
+	return(sock);
+}
+
+// build and send a request datagram of mode wgsig_register, wgsig_poll or wgsig_fetch to sv, for all the
+// response datagrams or only the one of index page, from local port (of parity) port, with the cookie
+// received from sv for this port if any
+int send_request(int sock, int mode, int page, struct server *sv, uint16_t port) {
+	uint8_t outpacket[wgsig_request_max];
+	int len=wgsig_request(&session, mode, page, &sv->cookie[port%2], outpacket, sizeof(outpacket));
+	if(sendto(sock,outpacket,len,0,(struct sockaddr*)&sv->addr,sizeof(struct sockaddr_in))<0) {
 		perror("sendto");
-		exit(1);
+		return(-1);
+	}
+	return(0);
+}
+
+// update the round-trip time estimators of a server with a new sample
+void rtt_sample(struct server *sv, int64_t rtt) {
+	if(!sv->srtt) {
+		sv->srtt=rtt;
+		sv->rttvar=rtt/2;
+	} else {
+		int64_t err=sv->srtt-rtt;
+		sv->rttvar+=((err<0 ? -err : err)-sv->rttvar)/4;
+		sv->srtt+=(rtt-sv->srtt)/8;
+	}
+}
+
+// time to wait for a server before sending a hedged request to the next one
+int64_t hedge_delay(struct server *sv) {
+	if(!sv->srtt) return(1000000);
+	int64_t d=sv->srtt+4*sv->rttvar;
+	return(d<10000 ? 10000 : (d>1000000 ? 1000000 : d));
+}
+
+// initial retransmission timeout for a server (RFC 6298, with a lower bound suited to a
+// single-datagram exchange)
+int64_t initial_rto(struct server *sv) {
+	if(!sv->srtt) return(1000000);
+	int64_t d=sv->srtt+(4*sv->rttvar>10000 ? 4*sv->rttvar : 10000);
+	return(d<200000 ? 200000 : d);
+}
+
+// randomize a delay by +/-25%, so that clients losing the same datagram do not retry in sync
+int64_t jitter(int64_t d) {
+	return(d*3/4+random()%(d/2+1));
+}
+
+// order in which servers are tried: by smoothed round-trip time, servers which did not
+// answer recently and servers not measured yet last
+int64_t server_score(struct server *sv) {
+	return((sv->srtt ? sv->srtt : 1000000)+(int64_t)sv->fails*1000000);
+}
+
+// drop datagrams left over from a previous exchange
+void drain_socket(int sock) {
+	uint8_t buf[resp_max_size+enc_overhead];
+	while(recv(sock, buf, sizeof(buf), MSG_DONTWAIT)>=0) ;
+}
+
+// peers written as soon as their records were received, during the current exchange
+static struct wgsig_view streamed;
+
+// write the records of the response from index first, but those of the peers already written, which
+// the response brings again when it is collected again
+void stream_records(int first) {
+	int n=0;
+	for(int i=first;i<session.view.n;i++) {
+		uint8_t *rec=session.view.recs+i*rec_size;
+		int k;
+		for(k=0;k<streamed.n && memcmp(streamed.recs+k*rec_size, rec, peer_id_size);k++);
+		if(k<streamed.n) continue;
+		memcpy(streamed.recs+(streamed.n++)*rec_size, rec, rec_size);
+		n++;
 	}
+	fflush(stdout);
+	write_all(1, out_buf, render_records(out_buf, streamed.recs+(streamed.n-n)*rec_size, n, my_id, out_format, time(NULL)));
+}
 
-	// receive response datagram(s)
-	uint8_t inpacket[keep_peers*rec_size+8+hmac_size];
-	unsigned int addrlen=sizeof(struct sockaddr_in);
-	uint8_t endrecv=0;
-	while(!endrecv) {
-		//if(recvfrom(sock,inpacket,keep_peers*rec_size+8+hmac_size,0,(struct sockaddr*)&saddr,&addrlen)<0) {
-		if(recvfrom_clear(sock, inpacket, keep_peers*rec_size+8+hmac_size,(struct sockaddr*)&saddr,&addrlen,NULL/*group*/)<0) {
+// exchange a request and the response datagrams with the servers: send a request to the best server,
+// and hedged requests to the next ones each time the previous one did not answer within its usual delay
+// requests are retransmitted to the servers asked so far when the retransmission timeout expires,
+// doubling the timeout each time; each request carries a new TAI64N label, as the server rejects
+// labels it has already seen
+// once a server answered, the response datagrams are accepted in any order from this server only,
+// and on timeout only the missing ones are requested again, or at once if the database changed in between
+// returns the server which answered, with its complete response in session, or NULL on timeout or error
+struct server *query(int sock, uint16_t port, int timeout_ms) {
+	struct server *order[max_servers];
+	int n=0;
+	for(int i=0;i<n_servers;i++) {
+		servers[i].sends=0;
+		servers[i].rtt=0;
+		if(resolve_server(&servers[i])<0) continue;
+		int k;
+		for(k=n;k>0 && server_score(order[k-1])>server_score(&servers[i]);k--)
+			order[k]=order[k-1];
+		order[k]=&servers[i];
+		n++;
+	}
+	if(!n) return(NULL);
+	wgsig_start(&session);
+	streamed.n=0;
+	drain_socket(sock);
+	int mode=(port % 2 == 1 ? wgsig_poll|(subscribe ? wgsig_subscribe : 0) : wgsig_register);
+	int64_t start=mono_us(), now=start, deadline=start+(int64_t)timeout_ms*1000, next_hedge=start;
+	// leave all the servers a chance to answer before the timeout
+	int64_t max_delay=(int64_t)timeout_ms*1000/n;
+	int64_t rto=initial_rto(order[0]), next_rto=start+jitter(rto);
+	int next=0;
+	struct server *answered=NULL;
+	last_attempts=1;
+	struct pollfd pfd;
+	pfd.fd=sock;
+	pfd.events=POLLIN;
+	for(;;) {
+		now=mono_us();
+		if(next<n && now>=next_hedge) {
+			struct server *sv=order[next++];
+			sv->sent_at=now;
+			sv->sends++;
+			send_request(sock, mode, -1, sv, port);
+			int64_t delay=hedge_delay(sv);
+			next_hedge=now+(delay<max_delay ? delay : max_delay);
+		}
+		if(now>=next_rto) {
+			if(answered) {
+				// request the missing datagrams again, without updating the database
+				uint16_t missing=wgsig_missing(&session);
+				for(int page=0;page<max_pages;page++)
+					if(missing&(1<<page))
+						send_request(sock, wgsig_fetch, page, answered, port);
+			} else {
+				for(int i=0;i<next;i++) {
+					order[i]->sent_at=now;
+					order[i]->sends++;
+					send_request(sock, mode, -1, order[i], port);
+				}
+			}
+			last_attempts++;
+			rto=(rto<5000000 ? 2*rto : 10000000);
+			next_rto=now+jitter(rto);
+		}
+		if(now>=deadline) break;
+		int64_t until=(next<n && next_hedge<next_rto ? next_hedge : next_rto);
+		if(until>deadline) until=deadline;
+		int r=poll(&pfd, 1, (int)((until-now+999)/1000));
+		if(r<0 && errno!=EINTR) break;
+		if(r<=0) continue;
+		uint8_t inpacket[wgsig_response_max];
+		struct sockaddr_in from;
+		socklen_t addrlen=sizeof(struct sockaddr_in);
+		int len=recvfrom(sock, inpacket, sizeof(inpacket), 0, (struct sockaddr*)&from, &addrlen);
+		if(len<0) {
 			perror("recvfrom");
-			exit(1);
+			break;
+		}
+		// only consider responses from the servers asked during this exchange,
+		// and from the server which answered first
+		struct server *sv=NULL;
+		for(int i=0;i<next;i++)
+			if(order[i]->addr.sin_addr.s_addr==from.sin_addr.s_addr && order[i]->addr.sin_port==from.sin_port)
+				sv=order[i];
+		if(!sv || (answered && sv!=answered)) continue;
+		int first=session.view.n, restarts=session.restarts;
+		int res=wgsig_input(&session, &sv->cookie[port%2], inpacket, len);
+		// a server under load asks for a cookie: send the request again at once with it, or the
+		// missing datagrams at the next retransmission
+		if(res==wgsig_in_cookie) {
+			if(!answered) {
+				sv->sent_at=mono_us();
+				sv->sends++;
+				send_request(sock, mode, -1, sv, port);
+			}
+			continue;
 		}
-		// verify response HMAC
-		uint8_t hmac[32];
-		hmac_sha256(hmac, inpacket, keep_peers*rec_size+8, secret, secret_size);
-		if(str_nequ_ctime(hmac, inpacket+keep_peers*rec_size+8)) {
+		if(res==wgsig_in_bad_hmac)
 			printf("received datagram with wrong hmac\n");
-		} else {
-			endrecv=1;
-			// loop through response records
-			for(int i=0;i<keep_peers;i++) {
-				for(int j=0;j<rec_size;j++) {
-					if(inpacket[i*rec_size+j]) {
-						// found non-zero record, print corresponding Wireguard configuration
-						print_record(inpacket+i*rec_size, my_id, 1);
-						if(atoi(argv[5]) % 2 == 0) {
-							// ping the peer
-							memcpy(&(saddr.sin_addr),inpacket+i*rec_size+peer_id_size,4);
-							saddr.sin_addr.s_addr^=ip_mask;
-							memcpy(&(saddr.sin_port),inpacket+i*rec_size+peer_id_size+4,2);
-							long x=random();
-							memcpy(outpacket, &x, sizeof(long));
-							if(sendto(sock, outpacket, sizeof(long), 0, (struct sockaddr*)&saddr, sizeof(struct sockaddr_in))<0) { perror("sendto"); }
-						}
-						break;
-					}
+		// pushes are not part of the exchange, which brings the current peers anyway
+		if(res<=0 || res==wgsig_in_push) continue;
+		now=mono_us();
+		if(session.restarts!=restarts) {
+			first=0;
+			if(answered) next_rto=now;
+		}
+		// write the records of the datagram as soon as it is received
+		if(stream_output)
+			stream_records(first);
+		if(!answered) {
+			answered=sv;
+			// no more hedged requests
+			next=n;
+			// Karn's algorithm: the response to a retransmitted request can not be matched to a request
+			sv->rtt=now-sv->sent_at;
+			if(sv->sends==1)
+				rtt_sample(sv, sv->rtt);
+			sv->fails=0;
+			// servers asked before this one were slower
+			for(int i=0;order[i]!=sv;i++)
+				order[i]->fails++;
+			// the other datagrams were sent along with this one: ask them again if they
+			// do not arrive soon
+			rto=initial_rto(sv);
+			next_rto=now+rto;
+		}
+		if(res==wgsig_in_complete) {
+			last_elapsed=now-start;
+			return(sv);
+		}
+	}
+	if(!answered)
+		for(int i=0;i<next;i++)
+			order[i]->fails++;
+	return(NULL);
+}
+
+// report the round-trip times measured during the last exchange
+void print_servers(void) {
+	for(int i=0;i<n_servers;i++) {
+		struct server *sv=&servers[i];
+		if(!sv->sends) continue;
+		if(sv->rtt)
+			printf("# Server %s:%d rtt %.1f ms\n", sv->host, sv->port, sv->rtt/1000.);
+		else
+			printf("# Server %s:%d no response\n", sv->host, sv->port);
+	}
+	printf("# Response after %u attempt%s, %.1f ms\n", last_attempts, (last_attempts>1 ? "s" : ""), last_elapsed/1000.);
+	if(session.advice)
+		printf("# Server advises polling every %d s\n", session.advice);
+}
+
+// endpoints of the peers to ping from the (even) Wireguard port after a registration
+static struct sockaddr_in punch_dst[max_peers];
+static int64_t punch_next[max_peers];
+static int n_punch=0;
+
+// collect the endpoints of the peers of a view
+void punch_prepare(struct wgsig_view *v) {
+	n_punch=0;
+	for(int i=0;i<v->n;i++) {
+		struct sockaddr_in *paddr=&punch_dst[n_punch++];
+		bzero(paddr, sizeof(struct sockaddr_in));
+		paddr->sin_family=AF_INET;
+		memcpy(&(paddr->sin_addr),v->recs+i*rec_size+peer_id_size,4);
+		paddr->sin_addr.s_addr^=ip_mask;
+		memcpy(&(paddr->sin_port),v->recs+i*rec_size+peer_id_size+4,2);
+	}
+}
+
+// ping the n peers of index idx with a random 8-byte payload, with a single system call
+void punch_send(int sock, int *idx, int n) {
+	struct iovec iov[n];
+	struct sockaddr_in dst[n];
+	long x[n];
+	for(int i=0;i<n;i++) {
+		x[i]=random();
+		iov[i].iov_base=&x[i];
+		iov[i].iov_len=sizeof(long);
+		dst[i]=punch_dst[idx[i]];
+	}
+	if(n && send_batch(sock, iov, dst, n)<0) perror("sendto");
+}
+
+void punch_all(int sock) {
+	int idx[max_peers];
+	for(int i=0;i<n_punch;i++) idx[i]=i;
+	punch_send(sock, idx, n_punch);
+}
+
+static void sleep_until(int64_t t) {
+	int64_t now=mono_us();
+	if(t>now) {
+		struct timespec ts={ (t-now)/1000000, ((t-now)%1000000)*1000 };
+		nanosleep(&ts, NULL);
+	}
+}
+
+// after the first burst sent by punch_all(), ping all the peers again 100, 300, 700... ms later (up to
+// punch_rounds bursts), then until punch_hold seconds elapsed, send them keepalives every
+// keepalive_period seconds to refresh the mappings of the NATs
+// the keepalives of the peers start at random times in the period, and at most keepalive_rate are
+// sent per second, so that they do not leave in bursts
+void punch_schedule(int sock) {
+	int64_t start=mono_us();
+	for(unsigned int r=1;r<punch_rounds;r++) {
+		sleep_until(start+100000*(((int64_t)1<<r)-1));
+		punch_all(sock);
+	}
+	int64_t now=mono_us(), hold_end=start+(int64_t)punch_hold*1000000, last_refill=now;
+	double tokens=1;
+	for(int i=0;i<n_punch;i++)
+		punch_next[i]=now+random()%(keepalive_period*1000000);
+	while(n_punch && now<hold_end) {
+		tokens+=(now-last_refill)*keepalive_rate/1e6;
+		if(tokens>keepalive_rate/10.) tokens=keepalive_rate/10.;
+		last_refill=now;
+		int idx[max_peers], n=0;
+		int64_t wakeup=hold_end;
+		for(int i=0;i<n_punch;i++) {
+			if(punch_next[i]<=now && n+1<=tokens) {
+				idx[n++]=i;
+				punch_next[i]+=keepalive_period*1000000;
+			}
+			if(punch_next[i]<wakeup) wakeup=punch_next[i];
+		}
+		punch_send(sock, idx, n);
+		tokens-=n;
+		// wait for the next keepalive due, or for a token if one is already due
+		if(wakeup<=now) wakeup=now+1000000/keepalive_rate;
+		sleep_until(wakeup);
+		now=mono_us();
+	}
+}
+
+// write the records of a view in the output format, with a single write(2)
+// (only the [Interface] section, if they were written when received)
+void print_view(struct wgsig_view *v, uint16_t port) {
+	fflush(stdout);
+	write_all(1, out_buf, render_view(out_buf, v->recs, (stream_output ? 0 : v->n), my_id, out_format, (port % 2 == 0 ? port : 0), time(NULL)));
+}
+
+// search a Peer ID in a view, returns its record or NULL
+uint8_t *view_search(struct wgsig_view *v, uint8_t *peer_id) {
+	for(int k=0;k<v->n;k++)
+		if(!memcmp(v->recs+k*rec_size, peer_id, peer_id_size))
+			return(v->recs+k*rec_size);
+	return(NULL);
+}
+
+// print the wg(8) commands turning the old view of the peers into the new one:
+// set the endpoint of new peers and peers whose endpoint changed, remove peers no longer known to the server
+void print_wg_set(struct wgsig_view *old, struct wgsig_view *new, uint16_t port) {
+	unsigned char peerid_b64[45];
+	if(!old && port % 2 == 0)
+		printf("wg set %s listen-port %d\n", wg_ifname, port);
+	for(int i=0;i<new->n;i++) {
+		uint8_t *rec=new->recs+i*rec_size, *prev;
+		if(!memcmp(rec, my_id, peer_id_size)) continue;
+		if(old && (prev=view_search(old, rec)) && !memcmp(prev+addr_off, rec+addr_off, 6)) continue;
+		uint32_t ip;
+		memcpy(&ip,rec+addr_off,4);
+		ip^=ip_mask;
+		uint16_t rport;
+		memcpy(&rport,rec+port_off,2);
+		base64_encode_keys(rec, 1, peerid_b64, 45);
+		printf("wg set %s peer %s endpoint %u.%u.%u.%u:%hu\n", wg_ifname, peerid_b64, ip&255, (ip>>8)&255, (ip>>16)&255, (ip>>24)&255, ntohs(rport));
+	}
+	for(int i=0;old && i<old->n;i++) {
+		uint8_t *rec=old->recs+i*rec_size;
+		if(!memcmp(rec, my_id, peer_id_size) || view_search(new, rec)) continue;
+		base64_encode_keys(rec, 1, peerid_b64, 45);
+		printf("wg set %s peer %s remove\n", wg_ifname, peerid_b64);
+	}
+}
+
+// load the view cached by a previous run
+void load_view_cache(void) {
+	int fd=open(view_cache, O_RDONLY);
+	if(fd<0) return;
+	int r=read(fd, last_view.recs, max_peers*rec_size);
+	if(r>=0 && r%rec_size==0) {
+		last_view.n=r/rec_size;
+		last_view_ok=1;
+	}
+	close(fd);
+}
+
+// replace the cached view
+void save_view_cache(void) {
+	char tmp[strlen(view_cache)+5];
+	sprintf(tmp, "%s.tmp", view_cache);
+	int fd=open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+	if(fd<0 || write(fd, last_view.recs, last_view.n*rec_size)!=last_view.n*rec_size || close(fd) || rename(tmp, view_cache)) {
+		perror(view_cache);
+		if(fd>=0) unlink(tmp);
+	}
+}
+
+// find whether the set of (Peer ID, endpoint) pairs differs from the one last written
+// TAI64N labels are not compared, as they change at each poll of the peers
+int view_changed(struct wgsig_view *v) {
+	if(!last_view_ok || v->n!=last_view.n) return(1);
+	for(int i=0;i<v->n;i++) {
+		uint8_t *prev=view_search(&last_view, v->recs+i*rec_size);
+		if(!prev || memcmp(prev+addr_off, v->recs+i*rec_size+addr_off, 6)) return(1);
+	}
+	return(0);
+}
+
+// ping the peers if the response was received on the (even) Wireguard port, and write either the
+// wg(8) commands applying the changes since the last view, or the configuration skeleton
+// in daemon mode, nothing is written unless after a registration or if the peers changed
+// the peers are pinged again after the output is written, while the Wireguard port is held
+// the summary of the last exchange is left out of the output of a push, which did not come from one
+void process_response(int sock, struct wgsig_view *v, uint16_t port, uint8_t only_changes, uint8_t pushed) {
+	if(port % 2 == 0) {
+		punch_prepare(v);
+		punch_all(sock);
+	}
+	if(only_changes && port % 2 == 1 && !view_changed(v))
+		return;
+	// JSON output is only made of the records
+	if(!pushed && (wg_ifname || out_format!=out_json))
+		print_servers();
+	if(wg_ifname)
+		print_wg_set(last_view_ok ? &last_view : NULL, v, port);
+	else
+		print_view(v, port);
+	fflush(stdout);
+	last_view.n=v->n;
+	memcpy(last_view.recs, v->recs, v->n*rec_size);
+	last_view_ok=1;
+	if(view_cache)
+		save_view_cache();
+	if(port % 2 == 0)
+		punch_schedule(sock);
+}
+
+// one poll in daemon mode: exchange a request and response from port, output if the peers changed
+void daemon_poll(int sock, uint16_t port, int timeout_ms) {
+	if(!query(sock, port, timeout_ms)) {
+		printf("# Timed out\n");
+		fflush(stdout);
+		return;
+	}
+	process_response(sock, &session.view, port, 1, 0);
+}
+
+// wait for push datagrams on the polling socket for timeout_ms, and output the peers if the records they
+// carry changed the last view
+void wait_pushes(int sock, uint16_t port, int timeout_ms) {
+	int64_t until=mono_us()+(int64_t)timeout_ms*1000;
+	struct pollfd pfd={ sock, POLLIN, 0 };
+	for(int64_t now=mono_us();now<until;now=mono_us()) {
+		if(poll(&pfd, 1, (int)((until-now+999)/1000))<=0) continue;
+		uint8_t pkt[wgsig_response_max];
+		struct sockaddr_in from;
+		socklen_t addrlen=sizeof(struct sockaddr_in);
+		int len=recvfrom(sock, pkt, sizeof(pkt), 0, (struct sockaddr*)&from, &addrlen);
+		if(len<0) continue;
+		struct server *sv=NULL;
+		for(int i=0;i<n_servers;i++)
+			if(servers[i].addr.sin_addr.s_addr==from.sin_addr.s_addr && servers[i].addr.sin_port==from.sin_port)
+				sv=&servers[i];
+		if(!sv || !last_view_ok || wgsig_input(&session, &sv->cookie[port%2], pkt, len)!=wgsig_in_push)
+			continue;
+		static struct wgsig_view v;
+		v=last_view;
+		if(wgsig_merge(&v, &session.push))
+			process_response(sock, &v, port, 1, 1);
+	}
+}
+
+// daemon mode: poll every interval seconds from the odd port, or after the delay advised by the server
+// (jittered, so that its clients do not poll in sync), and register from local_port every
+// reg_interval seconds (only once at startup if reg_interval is 0) when local_port is even
+// the even port is only bound for the time of the registration, so that Wireguard can listen on it
+// each exchange is given up after the poll interval, or deadline seconds if shorter
+void run_daemon(unsigned int interval, unsigned int reg_interval, unsigned int deadline) {
+	uint16_t poll_port=local_port|1;
+	int poll_sock=open_socket(poll_port);
+	if(poll_sock<0) exit(1);
+	int timeout_ms=(interval<deadline ? interval : deadline)*1000;
+	time_t next_poll=mono_time(), next_reg=(local_port%2==0 ? next_poll : 0);
+	for(;;) {
+		time_t now=mono_time();
+		if(next_reg && now>=next_reg) {
+			int reg_sock=open_socket(local_port);
+			if(reg_sock>=0) {
+				daemon_poll(reg_sock, local_port, timeout_ms);
+				close(reg_sock);
+			}
+			next_reg=(reg_interval ? now+reg_interval : 0);
+			// the registration also fetched the peers, but only polls subscribe
+			next_poll=(subscribe ? now : now+interval);
+		}
+		if(now>=next_poll) {
+			daemon_poll(poll_sock, poll_port, timeout_ms);
+			next_poll=now+(session.advice ? jitter(session.advice) : interval);
+		}
+		now=mono_time();
+		time_t wakeup=(next_reg && next_reg<next_poll ? next_reg : next_poll);
+		if(wakeup>now) {
+			if(subscribe)
+				wait_pushes(poll_sock, poll_port, (wakeup-now)*1000);
+			else
+				sleep(wakeup-now);
+		}
+	}
+}
+
+// batch mode: the identities of a file, each exchanging a request and response from its own local port with
+// the servers of its group, all at once
+#define max_identities 64
+#define max_group_servers 4
+
+struct identity {
+	unsigned char id[peer_id_size];
+	uint16_t port;
+	char *ifname;
+	int sock;
+	struct wgsig_session session;
+	struct wgsig_cookie cookie;
+	// servers of the group, by decreasing preference, the one sent the last request, and the one which
+	// answered; time of the last request, round-trip time and retransmission timeout
+	int sv[max_group_servers], n_sv, cur;
+	struct server *answered;
+	int64_t sent_at, rtt, rto, next_rto;
+	unsigned int sends;
+	int done;
+};
+
+static struct identity *identities;
+static int n_identities=0;
+
+// the server host:port in servers, added if needed, so that each one is resolved once
+// returns its index, or -1 if there are too many servers
+int server_index(char *host, uint16_t port) {
+	for(int i=0;i<n_servers;i++)
+		if(servers[i].port==port && !strcmp(servers[i].host, host))
+			return(i);
+	if(n_servers==max_servers) return(-1);
+	struct server *sv=&servers[n_servers];
+	bzero(sv, sizeof(struct server));
+	sv->host=host;
+	sv->port=port;
+	return(n_servers++);
+}
+
+// read the identities of a file, one per line, given as the arguments of a single exchange:
+// <remote_host>[:<port>][,<remote_host2>[:<port2>]...] <remote_port> <base64_peerid> <secret_file> <local_port> [<interface>]
+// empty lines and lines starting with # are ignored
+void load_identities(char *file) {
+	FILE *f=fopen(file, "r");
+	if(!f) {
+		perror(file);
+		exit(6);
+	}
+	identities=calloc(max_identities, sizeof(struct identity));
+	char line[1024];
+	for(int lineno=1;fgets(line, sizeof(line), f);lineno++) {
+		char *save, *arg[6];
+		int n=0;
+		for(char *tok=strtok_r(line, " \t\r\n", &save); tok && n<6; tok=strtok_r(NULL, " \t\r\n", &save))
+			arg[n++]=tok;
+		if(!n || arg[0][0]=='#') continue;
+		if(n<5 || n_identities==max_identities) {
+			printf("%s:%d : %s\n", file, lineno, (n<5 ? "<remote_hosts> <remote_port> <base64_peerid> <secret_file> <local_port> expected" : "too many identities"));
+			exit(6);
+		}
+		struct identity *id=&identities[n_identities++];
+		if(strlen(arg[2])!=44 || base64_decode_keys((unsigned char*)arg[2],44,1,id->id)!=1) {
+			printf("%s:%d : peerid must be a base64-encoded 32-byte key of 44 chars\n", file, lineno);
+			exit(6);
+		}
+		struct group_key k;
+		if(load_key(&k, arg[3])) exit(6);
+		wgsig_init(&id->session, k.secret, id->id, max_size);
+		id->port=atoi(arg[4]);
+		id->ifname=(n>5 ? strdup(arg[5]) : NULL);
+		id->sock=-1;
+		char *list=strdup(arg[0]);
+		for(char *tok=strtok_r(list, ",", &save); tok && id->n_sv<max_group_servers; tok=strtok_r(NULL, ",", &save)) {
+			char *colon=strchr(tok, ':');
+			uint16_t port=atoi(arg[1]);
+			if(colon) {
+				*colon=0;
+				port=atoi(colon+1);
+			}
+			if((id->sv[id->n_sv]=server_index(tok, port))<0) {
+				printf("%s:%d : too many servers\n", file, lineno);
+				exit(6);
+			}
+			id->n_sv++;
+		}
+	}
+	fclose(f);
+}
+
+// resolve the servers of the group of an identity
+// returns 0 if at least one has a usable address, -1 otherwise
+int resolve_group(struct identity *id) {
+	int resolved=0;
+	for(int k=0;k<id->n_sv;k++)
+		if(resolve_server(&servers[id->sv[k]])==0) resolved++;
+	return(resolved ? 0 : -1);
+}
+
+// send the request of an identity, or the missing response datagrams once a server answered
+void identity_send(struct identity *id, int64_t now) {
+	uint8_t pkt[wgsig_request_max];
+	int mode=(id->port % 2 == 1 ? wgsig_poll : wgsig_register);
+	if(id->answered) {
+		uint16_t missing=wgsig_missing(&id->session);
+		for(int page=0;page<max_pages;page++)
+			if(missing&(1<<page)) {
+				int len=wgsig_request(&id->session, wgsig_fetch, page, &id->cookie, pkt, sizeof(pkt));
+				sendto(id->sock, pkt, len, 0, (struct sockaddr*)&id->answered->addr, sizeof(struct sockaddr_in));
+			}
+		return;
+	}
+	struct server *sv=&servers[id->sv[id->cur]];
+	int len=wgsig_request(&id->session, mode, -1, &id->cookie, pkt, sizeof(pkt));
+	if(sendto(id->sock, pkt, len, 0, (struct sockaddr*)&sv->addr, sizeof(struct sockaddr_in))<0)
+		perror("sendto");
+	id->sent_at=now;
+	id->sends++;
+}
+
+// exchange the requests and responses of all the identities, with a single poll loop: the requests are
+// all sent at once, each to the preferred server of its group, and retransmitted to the next one of the
+// group, with its own retransmission timeout, until timeout_ms elapsed
+// returns the number of identities which received a complete response
+int query_all(int timeout_ms) {
+	struct pollfd pfd[max_identities];
+	int64_t start=mono_us(), now=start, deadline=start+(int64_t)timeout_ms*1000;
+	int n_done=0;
+	for(int i=0;i<n_identities;i++) {
+		struct identity *id=&identities[i];
+		wgsig_start(&id->session);
+		pfd[i].fd=id->sock;
+		pfd[i].events=POLLIN;
+		// servers of the group by round-trip time, those which can not be resolved last
+		for(int a=0;a<id->n_sv;a++)
+			for(int b=a+1;b<id->n_sv;b++) {
+				struct server *x=&servers[id->sv[a]], *y=&servers[id->sv[b]];
+				if((!x->expiry && y->expiry) || (x->expiry && y->expiry && server_score(y)<server_score(x))) {
+					int t=id->sv[a];
+					id->sv[a]=id->sv[b];
+					id->sv[b]=t;
 				}
 			}
-			if(atoi(argv[5]) % 2 == 0)
-				printf("[Interface]\nListenPort = %d\n", atoi(argv[5]));
+		if(id->sock<0 || !servers[id->sv[0]].expiry) {
+			id->done=-1;
+			continue;
 		}
+		id->rto=initial_rto(&servers[id->sv[0]]);
+		id->next_rto=now+jitter(id->rto);
+		identity_send(id, now);
+	}
+	while(now<deadline) {
+		int64_t until=deadline;
+		int waiting=0;
+		for(int i=0;i<n_identities;i++) {
+			struct identity *id=&identities[i];
+			pfd[i].events=(id->done ? 0 : POLLIN);
+			if(id->done) continue;
+			waiting++;
+			if(now>=id->next_rto) {
+				// the next server of the group, unless one answered
+				if(!id->answered && id->n_sv>1) {
+					id->cur=(id->cur+1)%id->n_sv;
+					if(!servers[id->sv[id->cur]].expiry) id->cur=0;
+					bzero(&id->cookie, sizeof(struct wgsig_cookie));
+				}
+				identity_send(id, now);
+				id->rto=(id->rto<5000000 ? 2*id->rto : 10000000);
+				id->next_rto=now+jitter(id->rto);
+			}
+			if(id->next_rto<until) until=id->next_rto;
+		}
+		if(!waiting) break;
+		int r=poll(pfd, n_identities, (int)((until-now+999)/1000));
+		if(r<0 && errno!=EINTR) break;
+		now=mono_us();
+		for(int i=0;i<n_identities && r>0;i++) {
+			if(!(pfd[i].revents&POLLIN)) continue;
+			struct identity *id=&identities[i];
+			uint8_t inpacket[wgsig_response_max];
+			struct sockaddr_in from;
+			socklen_t addrlen=sizeof(struct sockaddr_in);
+			int len=recvfrom(id->sock, inpacket, sizeof(inpacket), 0, (struct sockaddr*)&from, &addrlen);
+			if(len<0) continue;
+			// only consider responses from the servers of the group, and from the one which answered first
+			struct server *sv=NULL;
+			for(int k=0;k<id->n_sv;k++)
+				if(servers[id->sv[k]].addr.sin_addr.s_addr==from.sin_addr.s_addr && servers[id->sv[k]].addr.sin_port==from.sin_port)
+					sv=&servers[id->sv[k]];
+			if(!sv || (id->answered && sv!=id->answered)) continue;
+			int restarts=id->session.restarts;
+			int res=wgsig_input(&id->session, &id->cookie, inpacket, len);
+			// the database changed: request the missing datagrams again at once
+			if(id->session.restarts!=restarts && id->answered)
+				id->next_rto=now;
+			if(res==wgsig_in_cookie && !id->answered)
+				identity_send(id, now);
+			if(res<=0 || res==wgsig_in_cookie || res==wgsig_in_push) continue;
+			if(!id->answered) {
+				id->answered=sv;
+				id->rtt=now-id->sent_at;
+				if(id->sends==1)
+					rtt_sample(sv, id->rtt);
+				id->rto=initial_rto(sv);
+				id->next_rto=now+id->rto;
+			}
+			if(res==wgsig_in_complete) {
+				id->done=1;
+				n_done++;
+			}
+		}
+	}
+	last_elapsed=now-start;
+	return(n_done);
+}
+
+// ping the peers of the identities which registered
+// returns their number
+int batch_punch(void) {
+	int n=0;
+	for(int i=0;i<n_identities;i++)
+		if(identities[i].done==1 && identities[i].port%2==0) {
+			punch_prepare(&identities[i].session.view);
+			punch_all(identities[i].sock);
+			n++;
+		}
+	return(n);
+}
+
+// batch mode: exchange the requests of all the identities at once, then write the peers of each one,
+// after a line giving its Peer ID and local port (unless in JSON), as wg(8) commands for its interface
+// if it has one; the identities registering from an even port ping their peers, all in the same bursts
+int run_batch(unsigned int deadline) {
+	for(int i=0;i<n_identities;i++)
+		if(resolve_group(&identities[i])==0)
+			identities[i].sock=open_socket(identities[i].port);
+	int n_done=query_all(deadline*1000);
+	int64_t punch_start=mono_us();
+	int punching=batch_punch();
+	for(int i=0;i<n_identities;i++) {
+		struct identity *id=&identities[i];
+		unsigned char b64[45];
+		memcpy(my_id, id->id, peer_id_size);
+		base64_encode_keys(id->id, 1, b64, 45);
+		int comments=(id->ifname || out_format!=out_json);
+		if(comments)
+			printf("# Identity %s port %u%s\n", b64, id->port, (id->done==1 ? "" : " timed out"));
+		if(id->done!=1) continue;
+		if(comments)
+			printf("# Server %s:%d rtt %.1f ms\n", id->answered->host, id->answered->port, id->rtt/1000.);
+		if(id->ifname) {
+			wg_ifname=id->ifname;
+			print_wg_set(NULL, &id->session.view, id->port);
+			wg_ifname=NULL;
+		} else
+			print_view(&id->session.view, id->port);
+		fflush(stdout);
+	}
+	for(unsigned int r=1;punching && r<punch_rounds;r++) {
+		sleep_until(punch_start+100000*(((int64_t)1<<r)-1));
+		batch_punch();
+	}
+	return(n_done==n_identities ? 0 : 2);
+}
+
+int main(int argc, char **argv) {
+	unsigned int interval=0, reg_interval=0, deadline=30;
+	char *identity_file=NULL;
+	int c;
+	while((c=getopt(argc, argv, "d:e:t:w:c:T:p:k:m:f:sI:"))!=-1) {
+		switch(c) {
+			case 'f':
+				if((out_format=render_format(optarg))<0) argc=0;
+				break;
+			case 'm': max_size=atoi(optarg); break;
+			case 'T': deadline=atoi(optarg); break;
+			case 'p': punch_rounds=atoi(optarg); break;
+			case 'k': punch_hold=atoi(optarg); break;
+			case 'd': interval=atoi(optarg); break;
+			case 'e': reg_interval=atoi(optarg); break;
+			case 't': resolve_ttl=atoi(optarg); break;
+			case 'w': wg_ifname=optarg; break;
+			case 'c': view_cache=optarg; break;
+			case 's': subscribe=1; break;
+			case 'I': identity_file=optarg; break;
+			default: argc=0;
+		}
+	}
+	argc-=optind-1;
+	argv+=optind-1;
+	if(identity_file) {
+		// each identity is exchanged once, and its interface given in the file
+		if(interval || punch_hold || wg_ifname || view_cache) {
+			printf("-I can't be combined with -d, -k, -w or -c: batch mode runs a single exchange per identity, with the interfaces given in <identity_file>\n");
+			exit(6);
+		}
+		if(argc!=1) {
+			printf("-I takes the identities from <identity_file>, instead of the arguments\n");
+			exit(6);
+		}
+		if(!deadline) deadline=1;
+		srandom(time(NULL)^getpid());
+		load_identities(identity_file);
+		exit(run_batch(deadline));
+	}
+	// the daemon only binds the Wireguard port for the time of each registration
+	if(interval && punch_hold) {
+		printf("-k can't be combined with -d: the daemon leaves the Wireguard port to Wireguard between registrations\n");
+		exit(6);
+	}
+	if(argc<6) {
+		printf("Usage : %s [-I <identity_file>] [-d <poll_interval> [-e <register_interval>] [-t <dns_ttl>] [-s]] [-w <interface> [-c <cache_file>]] [-T <deadline>] [-p <punch_rounds>] [-k <keepalive_time>] [-m <max_datagram_size>] [-f terse|wg|json|wgquick] <remote_host>[:<port>][,<remote_host2>[:<port2>]...] <remote_port> <base64_peerid> <secret_file> <local_port>\n<local_port> is even to request to update server's endpoint information\n-d runs as a daemon polling every <poll_interval> seconds from the odd port next to <local_port>\n-s subscribes the polling port to the endpoint changes pushed by the servers (<poll_interval> must be below 120 seconds)\n-w writes the wg(8) commands updating <interface> with the peers changed since the view cached in <cache_file> (or in memory)\nRequests are sent to the fastest server, then to the other ones if it does not answer in time,\nand retransmitted until a response arrives or <deadline> seconds (default 30) elapsed\nAfter a registration, the peers are pinged in <punch_rounds> bursts (default 4), then sent keepalives for <keepalive_time> seconds (not with -d)\n-m asks for response datagrams of at most <max_datagram_size> bytes (default 1400), carrying more than 10 peers each\n-f writes the peers as a list, a configuration skeleton (default), a JSON array, or a wg-quick configuration\n-I exchanges at once the requests of the identities of <identity_file> (instead of the arguments), one per line: <remote_hosts> <remote_port> <base64_peerid> <secret_file> <local_port> [<interface>]\n", argv[0]);
+		exit(6);
+	}
+	// base64-decode Peer ID
+	if(strlen(argv[3])!=44 || base64_decode_keys((unsigned char*)argv[3],44,1,my_id)!=1) {
+		printf("peerid must be a base64-encoded 32-byte key of 44 chars\n");
+		exit(6);
+	}
+	// read Group secret from supplied file
+	read_secret(argv[4]);
+	wgsig_init(&session, group_key.secret, my_id, max_size);
+	parse_servers(argv[1], atoi(argv[2]));
+	local_port=atoi(argv[5]);
+	if(view_cache)
+		load_view_cache();
+	if(!deadline) deadline=1;
+	srandom(time(NULL)^getpid());
+	if(interval) {
+		if(!resolve_ttl) resolve_ttl=1;
+		run_daemon(interval, reg_interval, deadline);
+	}
+	// prepare connection to remote server
+	int sock=open_socket(local_port);
+	if(sock<0) exit(1);
+	int resolved=0;
+	for(int i=0;i<n_servers;i++)
+		if(resolve_server(&servers[i])==0) resolved++;
+	if(!resolved) exit(3);
+	// exchange request and response datagrams
+	stream_output=!wg_ifname && (out_format==out_terse || out_format==out_wgconf);
+	if(!query(sock, local_port, deadline*1000)) {
+		printf("Timed out\n");
+		exit(2);
 	}
+	process_response(sock, &session.view, local_port, 0, 0);
 }
@@ -27,120 +27,139 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *
  */
-
 #include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/mman.h>
 #include "common.h"
 
-// peer_data is the database storage in memory, in the format of the response payload
-// peer_ptr is the index of the next free (or oldest) slot in the array
-static unsigned char peer_data[keep_peers*rec_size+8+hmac_size];
-static unsigned int peer_ptr=0;
+// optional replication to the other nodes of a cluster
+static char *cluster_key_file=NULL, *cluster_nodes=NULL;
+static uint16_t cluster_port=0;
 
-// search if a peer ID is in the database
-// if so, out contains its record
-// if not, out is zeroed
-void peer_search(unsigned char peer_id[peer_id_size], unsigned char *out) {
-	bzero(out, rec_size);
-	for(int i=0;i<keep_peers;i++) {
-		int j;
-		for(j=0;j<peer_id_size && peer_data[i*rec_size+j]==peer_id[j];j++);
-		if(j==peer_id_size) {
-			memcpy(out, peer_data+i*rec_size, rec_size);
-			return;
-		}
-	}
-}
+// files of the optional whitelist of Peer IDs, and of the current and next Group secrets
+static char *whitelist_file=NULL;
+static char *secret_file=NULL, *next_secret_file=NULL;
 
-// update database record at index, log and recompute HMAC of response payload
-void peer_replace_at(int index, unsigned char new_peer[rec_size], uint16_t update_endpoint) {
-	if(update_endpoint) {
-		// update the whole record
-		printf("update whole rec, index=%d\n",index);
-		memcpy(peer_data+index*rec_size, new_peer, rec_size);
-	} else {
-		// update TAI64N counter only
-		memcpy(peer_data+index*rec_size+38, new_peer+38, 12);
-	}
-	//if(update_endpoint) { printf("Endpoint updated\n"); }
-	//else { printf("Endpoint NOT updated\n"); }
-	print_record(peer_data+index*rec_size, NULL, 0);
-	hmac_sha256(peer_data+rec_size*keep_peers+8, peer_data, rec_size*keep_peers+8, secret, secret_size);
-}
+// the reload thread frees a replaced whitelist or keyring only once the request loop went through a
+// quiescent state: waiting for a datagram, or done with a datagram received before the replacement
+static int loop_waiting=0;
+static uint32_t loop_done=0;
 
-// update database by adding (or updating) new_peer record
-void peer_replace(unsigned char new_peer[rec_size], uint16_t update_endpoint) {
-	for(int i=0;i<keep_peers;i++) {
-		int j;
-		for(j=0;j<peer_id_size && peer_data[i*rec_size+j]==new_peer[j];j++);
-		if(j==peer_id_size) {
-			// peer already in database
-			peer_replace_at(i, new_peer, update_endpoint);
-			return;
-		}
-	}
-	// peer not in database, don't add to database if endpoint update not requested
-	if(update_endpoint) {
-		peer_replace_at(peer_ptr, new_peer, 1);
-		peer_ptr++;
-		if(peer_ptr==keep_peers) peer_ptr=0;
+void quiescent_wait(void) {
+	uint32_t done=__atomic_load_n(&loop_done, __ATOMIC_SEQ_CST);
+	while(!__atomic_load_n(&loop_waiting, __ATOMIC_SEQ_CST) && __atomic_load_n(&loop_done, __ATOMIC_SEQ_CST)==done) {
+		struct timespec ts={ 0, 1000000 };
+		nanosleep(&ts, NULL);
 	}
 }
 
-// check whether packet is valid
-// returns
-//  0 for accepted packet
-//  1 for rejected packet
-int packet_ok(unsigned char *inpacket) {
-		uint64_t my_time=time(NULL);
-		uint64_t pkt_tai64;
-		memcpy(&pkt_tai64, inpacket+pkt_counter_off, 8);
-		pkt_tai64=be64toh(pkt_tai64);
-		// bit 62 of TAI64 must be set (timestamp presumably after Jan 1, 1970), bit 63 unset (bit 63 set is reserved)
-		if( (pkt_tai64&((uint64_t)1<<62))==0 || (pkt_tai64&((uint64_t)1<<63))!=0 ) { 
-			printf("bogus inpacket TAI64 : %" PRIx64 "\n", pkt_tai64);
-			return(0);
-		}
-		// reject packets too far in the past or in the future
-		uint64_t peer_sec=pkt_tai64&(~((uint64_t)1<<62));
-		if( (peer_sec > my_time+30) || (peer_sec < my_time-30) ) {
-			printf("large time difference peer_sec=%" PRIx64 " my_time=%" PRIx64 "\n", peer_sec, my_time);
-			return(0);
+// signal thread: on SIGUSR1, dump the counters
+// on SIGHUP, read the secrets and compile the whitelist file again and swap them in,
+// without interrupting the request loop
+void *signal_thread(void *arg) {
+	sigset_t *set=arg;
+	int sig;
+	for(;;) {
+		if(sigwait(set, &sig)) continue;
+		if(sig==SIGUSR1) {
+			print_metrics();
+			continue;
 		}
-		// for already known peers, check that clock is strictly increasing
-		uint8_t this_peer[rec_size];
-		peer_search(inpacket, this_peer);
-		for(int i=0;i<rec_size;i++) {
-			if(this_peer[i]) {
-				memcpy(&my_time, this_peer+counter_off, 8);
-				my_time=be64toh(my_time)&(~((uint64_t)1<<62));
-				uint32_t my_ns=be32toh((uint32_t)this_peer[counter_off+8]);
-				uint32_t peer_ns=be32toh((uint32_t)inpacket[pkt_counter_off+8]);
-				if( (peer_sec<my_time) || (peer_sec==my_time && peer_ns<=my_ns) ) {
-					printf("old inpacket\n");
-					return(0);
-				}
-				break;
+		if(sig!=SIGHUP) continue;
+		struct keyring *kr=keyring_load(secret_file, next_secret_file);
+		if(kr) {
+			struct keyring *old=__atomic_exchange_n(&keys, kr, __ATOMIC_SEQ_CST);
+			printf("secrets reloaded, %d keys\n", kr->n);
+			quiescent_wait();
+			free(old);
+		} else
+			printf("keeping previous secrets\n");
+		if(whitelist_file) {
+			struct whitelist *wl=whitelist_load(whitelist_file);
+			if(!wl) {
+				printf("keeping previous whitelist\n");
+				continue;
 			}
+			struct whitelist *old=__atomic_exchange_n(&whitelist, wl, __ATOMIC_SEQ_CST);
+			printf("whitelist reloaded, %d peers\n", wl->n);
+			quiescent_wait();
+			whitelist_free(old);
 		}
-		// compute and check HMAC
-		uint8_t my_hmac[32];
-		hmac_sha256(my_hmac, inpacket, pkt_size-hmac_size, secret, secret_size);
-		//for(int i=0;i<hmac_size;i++) printf("%x ",my_hmac[i]);printf("\n");
-		//for(int i=0;i<hmac_size;i++) printf("%x ",inpacket[pkt_hmac_off+i]);printf("\n");
-		if(str_nequ_ctime(my_hmac, inpacket+pkt_hmac_off)) {
-			printf("wrong hmac\n");
-			return(0);
-		}
-		return(1);
+	}
+	return(NULL);
+}
+
+// create the shared memory object name, and export the database in it
+void shm_export(char *name) {
+	int fd=shm_open(name, O_RDWR|O_CREAT, 0640);
+	if(fd<0 || ftruncate(fd, sizeof(struct shm_db))) {
+		perror(name);
+		exit(1);
+	}
+	shm=mmap(NULL, sizeof(struct shm_db), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm==MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	bzero(shm, sizeof(struct shm_db));
+	shm->magic=shm_magic;
 }
 
 int main(int argc, char **argv) {
-	if(argc<2) {
-		printf("Usage : %s <secret_file> [<port>=%d]\n", argv[0], listen_port);
+	int c;
+	char *shm_name=NULL, *trace_file=NULL;
+	FILE *trace=NULL;
+	int n_verifiers=0;
+	while((c=getopt(argc, argv, "w:n:K:L:R:s:ct:j:"))!=-1) {
+		switch(c) {
+			case 'j': n_verifiers=atoi(optarg); break;
+			case 't': trace_file=optarg; break;
+			case 'c': cookie_policy=cookies_always; break;
+			case 's': shm_name=optarg; break;
+			case 'w': whitelist_file=optarg; break;
+			case 'n': next_secret_file=optarg; break;
+			case 'K': cluster_key_file=optarg; break;
+			case 'L': cluster_port=atoi(optarg); break;
+			case 'R': cluster_nodes=optarg; break;
+			default: argc=0;
+		}
+	}
+	argc-=optind-1;
+	argv+=optind-1;
+	if(argc<2 || (cluster_key_file!=NULL)!=(cluster_nodes!=NULL) || (cluster_key_file && !cluster_port) || n_verifiers<0 || n_verifiers>max_verifiers) {
+		printf("Usage : %s [-w <whitelist_file>] [-n <next_secret_file>] [-K <cluster_key_file> -L <cluster_port> -R <node_host>:<node_port>[,<node_host2>:<node_port2>...]] [-s <shm_name>] [-c] [-t <trace_file>] [-j <verifier_threads>] <secret_file> [<port>=%d]\n-w only accepts requests from the Peer IDs listed in <whitelist_file>\n-n also accepts requests authenticated by the secret in <next_secret_file>, if it exists\nSecrets and whitelist are reloaded on SIGHUP, counters are written on SIGUSR1\n-K replicates the database with the other nodes of a cluster, which listen on the UDP ports given by -R,\nwith messages authenticated by the secret in <cluster_key_file>, received on <cluster_port>\n-s exports the database in the POSIX shared memory object <shm_name>, for wgsigshm\n-c always requires cookies from the clients, instead of only under load\n-t writes the received datagrams to <trace_file>, for wgsigreplay\n-j decrypts and authenticates the requests in <verifier_threads> threads (at most %d) along with the request loop\n", argv[0], listen_port, max_verifiers);
+		exit(1);
+	}
+	secret_file=argv[1];
+	if(!(keys=keyring_load(secret_file, next_secret_file)))
+		exit(6);
+	if(whitelist_file && !(whitelist=whitelist_load(whitelist_file)))
+		exit(6);
+	if(shm_name)
+		shm_export(shm_name);
+	if(trace_file && !(trace=trace_create(trace_file))) {
+		perror(trace_file);
 		exit(1);
 	}
-	read_secret(argv[1]);
-	bzero(peer_data, keep_peers*rec_size+8+hmac_size);
+	if(cluster_key_file)
+		cluster_sock=cluster_open(cluster_key_file, cluster_nodes, cluster_port);
+	// handle SIGHUP and SIGUSR1 in the signal thread only
+	static sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	pthread_t signal_tid;
+	if(pthread_create(&signal_tid, NULL, signal_thread, &set)) {
+		printf("can't create signal thread\n");
+		exit(1);
+	}
+	if(n_verifiers)
+		pipeline_start(n_verifiers);
 	// prepare server socket
 	unsigned int sock=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 	struct sockaddr_in saddr;
@@ -152,33 +171,63 @@ int main(int argc, char **argv) {
 		perror("bind");
 		exit(1);
 	}
-	struct sockaddr_in cl_addr;
-	unsigned int cl_addrlen=sizeof(struct sockaddr_in);
-	unsigned char inpacket[pkt_size];
-	// loop through received datagrams
+	// loop through batches of received datagrams
 	// we do not fork as each received datagram can be processed quickly
-	while(recvfrom_clear(sock,inpacket,pkt_size,(struct sockaddr*)&cl_addr,&cl_addrlen,NULL /*group*/)) {
-		if(packet_ok(inpacket)) {
-			// create record associated with this request
-			uint16_t clflg=*(uint16_t*)(inpacket+pkt_clflg_off);
-			clflg=ntohs(clflg);
-			// illogical request, update endpoint without updating TAI64: force update of both
-			if(!(clflg&1)&&(clflg&2)) clflg&=~3;
-			if(!(clflg&1)||!(clflg&2)) { // if an update is requested
-				unsigned char this_peer[rec_size];
-				memcpy(this_peer, inpacket, peer_id_size);
-				if(!(clflg&1)) { // if endpoint update is requested
-					memcpy(this_peer+addr_off, &(cl_addr.sin_addr), 4);
-					*(uint32_t*)(this_peer+addr_off)^=ip_mask;
-					memcpy(this_peer+port_off, &(cl_addr.sin_port), 2);
-				}
-				memcpy(this_peer+counter_off, inpacket+peer_id_size, 12);
-				// insert record
-				peer_replace(this_peer, !(clflg&1));
+	static struct request rx[rx_batch];
+	struct iovec iov[rx_batch];
+	struct sockaddr_in src[rx_batch];
+	struct timespec *ts=NULL;
+	int len[rx_batch];
+#ifdef STAGE_STATS
+	// kernel receive times, to measure the time requests wait in the socket buffer
+	static struct timespec rx_ts[rx_batch];
+	int on=1;
+	if(setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)))
+		perror("SO_TIMESTAMPNS");
+	else
+		ts=rx_ts;
+#endif
+	for(int i=0;i<rx_batch;i++) {
+		iov[i].iov_base=rx[i].pkt;
+		iov[i].iov_len=sizeof(rx[i].pkt);
+	}
+	struct pollfd pfd[2]={ { sock, POLLIN, 0 }, { cluster_sock, POLLIN, 0 } };
+	for(;;) {
+		// only wait for datagrams if no request is queued, and write the trace before
+		int pending=server_pending();
+		if(trace && !pending)
+			fflush(trace);
+		__atomic_store_n(&loop_waiting, !pending, __ATOMIC_SEQ_CST);
+		if(cluster_sock>=0) {
+			// wait for a request, a replication message or the next anti-entropy round
+			int r=poll(pfd, 2, (pending ? 0 : cluster_tick()));
+			__atomic_store_n(&loop_waiting, 0, __ATOMIC_SEQ_CST);
+			if(r>0 && (pfd[1].revents&POLLIN))
+				cluster_receive();
+			if(!pending && (r<=0 || !(pfd[0].revents&POLLIN))) {
+				__atomic_add_fetch(&loop_done, 1, __ATOMIC_SEQ_CST);
+				continue;
 			}
-			// send response datagram
-			if(sendto_clear(sock,peer_data,rec_size*keep_peers+8+hmac_size,(struct sockaddr*)&cl_addr,cl_addrlen,0 /*group*/)<0) perror("sendto"); 
+			__atomic_store_n(&loop_waiting, !pending, __ATOMIC_SEQ_CST);
+		}
+		int n=recv_batch(sock, iov, src, len, ts, rx_batch, !pending);
+		__atomic_store_n(&loop_waiting, 0, __ATOMIC_SEQ_CST);
+		if(n<0) {
+			if(errno!=EINTR && errno!=EAGAIN && errno!=EWOULDBLOCK) break;
+			n=0;
+		}
+		for(int i=0;i<n;i++) {
+			rx[i].addr=src[i];
+			rx[i].len=len[i];
+			if(ts) rx[i].ts=ts[i];
+		}
+		if(trace && n>0) {
+			struct timespec tp;
+			clock_gettime(CLOCK_REALTIME, &tp);
+			trace_write(trace, rx, n, (uint64_t)tp.tv_sec*1000000000+tp.tv_nsec);
 		}
+		serve_batch(sock, rx, n);
+		__atomic_add_fetch(&loop_done, 1, __ATOMIC_SEQ_CST);
 	}
 	perror("recvfrom");
 	exit(1);
@@ -0,0 +1,402 @@
+/* wgsignat.c - NAT simulator for a NAT traversal and endpoint discovery protocol for Wireguard
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2022, Alexandre Janon <alex14fr@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// userspace NAT simulator, measuring how long clients behind NATs take to reach each other
+//
+// each run starts wgsigd on port and n_clients wgsigc, each behind its own simulated NAT with the public
+// address 127.0.1.<index+1>; client i uses the ports port+2+2i (even, registration and pings) and the next
+// odd one (polls), and is given the gateway port+1 as the address of the server
+// the simulator owns the external sockets of the NAT mappings: a client sending to the gateway goes out
+// through a mapping to the server, and the responses of the server coming in through this mapping are
+// delivered to the client from the gateway; a client sending to the external address of a mapping of
+// another client (its endpoint, learned from the server) goes out through one of its own mappings, and
+// comes in through the one of the peer, if its filtering lets it in
+// mappings are endpoint-independent, address-dependent or address and port-dependent, and so is the
+// filtering; they expire after timeout seconds without outgoing datagram, and datagrams are lost with
+// a probability of loss percent at each NAT crossed
+// a run ends when every pair of clients reached each other in both directions, or after run_time seconds
+
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "common.h"
+
+#define max_clients 32
+#define max_mappings 64
+#define max_permits 32
+#define nat_ei 0
+#define nat_ad 1
+#define nat_apd 2
+
+// a NAT mapping, for datagrams sent from the inside port to dst (depending on the mapping behaviour),
+// and the remote endpoints it sent datagrams to, for the filtering
+struct mapping {
+	int sock;
+	struct sockaddr_in ext;
+	uint16_t inside;
+	struct sockaddr_in dst;
+	struct sockaddr_in permit[max_permits];
+	int n_permits;
+	int64_t last;
+};
+
+struct nat {
+	struct in_addr public;
+	struct mapping map[max_mappings];
+	pid_t pid;
+};
+
+static struct nat nats[max_clients];
+static int n_clients=3, mapping_mode=nat_ei, filtering_mode=nat_ei, loss=0;
+static int64_t map_timeout=30000;
+static struct sockaddr_in server_addr;
+static uint16_t base_port=12300;
+static int gateway=-1;
+static volatile sig_atomic_t stop=0;
+
+// time at which a datagram of client i first reached client j in the current run, 0 if none yet
+static int64_t first_rx[max_clients][max_clients];
+
+static struct {
+	uint64_t forwarded, filtered, lost, mappings, expired;
+} counters;
+
+static int64_t mono_ms(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return((int64_t)tp.tv_sec*1000+tp.tv_nsec/1000000);
+}
+
+static int same_addr(struct sockaddr_in *a, struct sockaddr_in *b, int with_port) {
+	return(a->sin_addr.s_addr==b->sin_addr.s_addr && (!with_port || a->sin_port==b->sin_port));
+}
+
+// the client whose inside port is port, or -1
+static int client_of(uint16_t port) {
+	int i=(port-base_port-2)/2;
+	return(port>=base_port+2 && i<n_clients ? i : -1);
+}
+
+static uint16_t inside_port(int i) {
+	return(base_port+2+2*i);
+}
+
+static int lost(void) {
+	if(random()%100>=loss) return(0);
+	counters.lost++;
+	return(1);
+}
+
+static void map_close(struct mapping *m) {
+	close(m->sock);
+	m->sock=-1;
+}
+
+// drop the mappings idle for longer than the timeout
+static void expire_mappings(int64_t now) {
+	for(int i=0;i<n_clients;i++)
+		for(int k=0;k<max_mappings;k++) {
+			struct mapping *m=&nats[i].map[k];
+			if(m->sock>=0 && now-m->last>map_timeout) {
+				map_close(m);
+				counters.expired++;
+			}
+		}
+}
+
+// the mapping of client i used to send from the inside port to dst, created if needed, with dst
+// allowed to send back through it
+// returns NULL if no mapping can be created
+static struct mapping *map_out(int i, uint16_t inside, struct sockaddr_in *dst, int64_t now) {
+	struct nat *nat=&nats[i];
+	struct mapping *m=NULL, *free_map=NULL;
+	for(int k=0;k<max_mappings && !m;k++) {
+		struct mapping *c=&nat->map[k];
+		if(c->sock<0) {
+			if(!free_map) free_map=c;
+			continue;
+		}
+		if(c->inside==inside && (mapping_mode==nat_ei || same_addr(&c->dst, dst, mapping_mode==nat_apd)))
+			m=c;
+	}
+	if(!m) {
+		if(!(m=free_map)) return(NULL);
+		m->sock=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		bzero(&m->ext, sizeof(struct sockaddr_in));
+		m->ext.sin_family=AF_INET;
+		m->ext.sin_addr=nat->public;
+		socklen_t len=sizeof(struct sockaddr_in);
+		if(m->sock<0 || bind(m->sock, (struct sockaddr*)&m->ext, len) || getsockname(m->sock, (struct sockaddr*)&m->ext, &len)) {
+			perror("mapping");
+			if(m->sock>=0) map_close(m);
+			return(NULL);
+		}
+		m->inside=inside;
+		m->dst=*dst;
+		m->n_permits=0;
+		counters.mappings++;
+	}
+	m->last=now;
+	int k;
+	for(k=0;k<m->n_permits && !same_addr(&m->permit[k], dst, 1);k++) ;
+	if(k==m->n_permits) {
+		if(m->n_permits<max_permits) m->n_permits++;
+		else k=random()%max_permits;
+		m->permit[k]=*dst;
+	}
+	return(m);
+}
+
+// whether the filtering of the mapping m lets in a datagram from src
+static int map_in(struct mapping *m, struct sockaddr_in *src) {
+	if(filtering_mode==nat_ei) return(1);
+	for(int k=0;k<m->n_permits;k++)
+		if(same_addr(&m->permit[k], src, filtering_mode==nat_apd))
+			return(1);
+	counters.filtered++;
+	return(0);
+}
+
+static void send_from(int sock, unsigned char *buf, int len, struct sockaddr_in *dst) {
+	if(sendto(sock, buf, len, 0, (struct sockaddr*)dst, sizeof(struct sockaddr_in))>=0)
+		counters.forwarded++;
+}
+
+static struct sockaddr_in local_addr(uint16_t port) {
+	struct sockaddr_in a;
+	bzero(&a, sizeof(struct sockaddr_in));
+	a.sin_family=AF_INET;
+	a.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+	a.sin_port=htons(port);
+	return(a);
+}
+
+// a datagram sent by a client to the gateway: forward it to the server
+static void from_gateway(unsigned char *buf, int len, struct sockaddr_in *src, int64_t now) {
+	int i=client_of(ntohs(src->sin_port));
+	if(i<0 || src->sin_addr.s_addr!=htonl(INADDR_LOOPBACK)) return;
+	struct mapping *m=map_out(i, ntohs(src->sin_port), &server_addr, now);
+	if(m && !lost())
+		send_from(m->sock, buf, len, &server_addr);
+}
+
+// a datagram received on the external socket of the mapping m of client j: from the server, deliver it
+// to the client from the gateway; from a client i, send it out through a mapping of i, then into m
+static void from_external(int j, struct mapping *m, unsigned char *buf, int len, struct sockaddr_in *src, int64_t now) {
+	if(same_addr(src, &server_addr, 1)) {
+		if(!map_in(m, src) || lost()) return;
+		struct sockaddr_in dst=local_addr(m->inside);
+		send_from(gateway, buf, len, &dst);
+		return;
+	}
+	int i=client_of(ntohs(src->sin_port));
+	// no hairpinning
+	if(i<0 || i==j || src->sin_addr.s_addr!=htonl(INADDR_LOOPBACK)) return;
+	struct mapping *out=map_out(i, ntohs(src->sin_port), &m->ext, now);
+	if(!out || lost() || !map_in(m, &out->ext) || lost()) return;
+	struct sockaddr_in dst=local_addr(m->inside);
+	send_from(out->sock, buf, len, &dst);
+	if(!first_rx[i][j]) first_rx[i][j]=now;
+}
+
+static pid_t spawn(char **argv) {
+	pid_t pid=fork();
+	if(pid==0) {
+		int null=open("/dev/null", O_WRONLY);
+		dup2(null, 1);
+		dup2(null, 2);
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	if(pid<0) perror("fork");
+	return(pid);
+}
+
+static void stop_process(pid_t pid) {
+	if(pid<=0) return;
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+static void on_signal(int sig) {
+	stop=1;
+}
+
+static int cmp_time(const void *a, const void *b) {
+	int64_t x=*(const int64_t*)a, y=*(const int64_t*)b;
+	return(x<y ? -1 : x>y);
+}
+
+// write the distribution of the n times of t (sorted), out of total pairs
+static void print_distribution(const char *what, int64_t *t, int n, int total) {
+	qsort(t, n, sizeof(int64_t), cmp_time);
+	printf("# %s: %d/%d pairs", what, n, total);
+	if(n)
+		printf(", min %" PRId64 " ms, median %" PRId64 " ms, 90%% %" PRId64 " ms, max %" PRId64 " ms", t[0], t[n/2], t[n*9/10], t[n-1]);
+	printf("\n");
+}
+
+static int parse_mode(const char *s) {
+	if(!strcmp(s, "ei")) return(nat_ei);
+	if(!strcmp(s, "ad")) return(nat_ad);
+	if(!strcmp(s, "apd")) return(nat_apd);
+	printf("%s : NAT behaviour must be ei, ad or apd\n", s);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	int c, runs=1, run_time=60;
+	char *client_opts="-d 5 -e 5";
+	while((c=getopt(argc, argv, "m:f:t:l:n:r:T:o:"))!=-1) {
+		switch(c) {
+			case 'm': mapping_mode=parse_mode(optarg); break;
+			case 'f': filtering_mode=parse_mode(optarg); break;
+			case 't': map_timeout=atoi(optarg)*1000; break;
+			case 'l': loss=atoi(optarg); break;
+			case 'n': n_clients=atoi(optarg); break;
+			case 'r': runs=atoi(optarg); break;
+			case 'T': run_time=atoi(optarg); break;
+			case 'o': client_opts=optarg; break;
+			default: argc=0;
+		}
+	}
+	argc-=optind-1;
+	argv+=optind-1;
+	if(argc<4 || n_clients<2 || n_clients>max_clients) {
+		printf("Usage : %s [-m ei|ad|apd] [-f ei|ad|apd] [-t <mapping_timeout>] [-l <loss_percent>] [-n <clients>] [-r <runs>] [-T <run_time>] [-o <wgsigc_options>] <wgsigd> <wgsigc> <secret_file> [<port>=12300]\nruns wgsigd on <port> and <clients> (default 3, at most %d) wgsigc with <wgsigc_options> (default \"-d 5 -e 5\"), each behind a simulated NAT,\nand reports how long the clients took to reach each other\n-m and -f set the mapping and filtering of the NATs: endpoint-independent (default), address-dependent, or address and port-dependent\n-t expires the mappings after <mapping_timeout> seconds (default 30) without outgoing datagram\n-l loses <loss_percent> %% of the datagrams at each NAT crossed\nEach of the <runs> runs (default 1) lasts until all the clients reached each other, or <run_time> seconds (default 60)\n", argv[0], max_clients);
+		exit(1);
+	}
+	if(argc>4) base_port=atoi(argv[4]);
+	srandom(time(NULL)^getpid());
+	server_addr=local_addr(base_port);
+	struct sockaddr_in gw_addr=local_addr(base_port+1);
+	gateway=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if(gateway<0 || bind(gateway, (struct sockaddr*)&gw_addr, sizeof(struct sockaddr_in))) {
+		perror("gateway bind");
+		exit(1);
+	}
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	// command lines of the server and of the clients, with the options of the clients split on spaces
+	char port_s[8], gw_s[8], inside_s[max_clients][8], key_s[max_clients][45];
+	snprintf(port_s, sizeof(port_s), "%u", base_port);
+	snprintf(gw_s, sizeof(gw_s), "%u", base_port+1);
+	char *server_argv[]={ argv[1], argv[3], port_s, NULL };
+	char *opts=strdup(client_opts), *client_argv[64];
+	int n_opts=1;
+	client_argv[0]=argv[2];
+	for(char *tok=strtok(opts, " "); tok && n_opts<55; tok=strtok(NULL, " "))
+		client_argv[n_opts++]=tok;
+	for(int i=0;i<n_clients;i++) {
+		unsigned char key[peer_id_size];
+		memset(key, i+1, peer_id_size);
+		base64_encode(key, peer_id_size, (unsigned char*)key_s[i]);
+		snprintf(inside_s[i], sizeof(inside_s[i]), "%u", inside_port(i));
+		nats[i].public.s_addr=htonl(INADDR_LOOPBACK|(1<<8)|(i+1));
+		for(int k=0;k<max_mappings;k++) nats[i].map[k].sock=-1;
+	}
+	int total=n_clients*(n_clients-1)/2;
+	int64_t *first_times=malloc(runs*total*sizeof(int64_t)), *both_times=malloc(runs*total*sizeof(int64_t));
+	int n_first=0, n_both=0, run;
+	for(run=0;run<runs && !stop;run++) {
+		bzero(first_rx, sizeof(first_rx));
+		pid_t server=spawn(server_argv);
+		struct timespec ts={ 0, 200000000 };
+		nanosleep(&ts, NULL);
+		int64_t start=mono_ms(), now=start;
+		for(int i=0;i<n_clients;i++) {
+			char *a[64];
+			memcpy(a, client_argv, n_opts*sizeof(char*));
+			char *args[]={ "-f", "terse", "127.0.0.1", gw_s, key_s[i], argv[3], inside_s[i], NULL };
+			memcpy(a+n_opts, args, sizeof(args));
+			nats[i].pid=spawn(a);
+		}
+		int connected=0;
+		while(!stop && !connected && now-start<run_time*1000) {
+			struct pollfd pfd[1+max_clients*max_mappings];
+			struct mapping *owner[1+max_clients*max_mappings];
+			int client[1+max_clients*max_mappings], n=1;
+			pfd[0].fd=gateway;
+			pfd[0].events=POLLIN;
+			for(int i=0;i<n_clients;i++)
+				for(int k=0;k<max_mappings;k++)
+					if(nats[i].map[k].sock>=0) {
+						pfd[n].fd=nats[i].map[k].sock;
+						pfd[n].events=POLLIN;
+						owner[n]=&nats[i].map[k];
+						client[n++]=i;
+					}
+			int r=poll(pfd, n, 100);
+			now=mono_ms();
+			for(int k=0;k<n && r>0;k++) {
+				if(!(pfd[k].revents&POLLIN)) continue;
+				unsigned char buf[2048];
+				struct sockaddr_in src;
+				socklen_t srclen=sizeof(struct sockaddr_in);
+				int len=recvfrom(pfd[k].fd, buf, sizeof(buf), 0, (struct sockaddr*)&src, &srclen);
+				if(len<0) continue;
+				if(!k)
+					from_gateway(buf, len, &src, now);
+				else
+					from_external(client[k], owner[k], buf, len, &src, now);
+			}
+			expire_mappings(now);
+			connected=1;
+			for(int i=0;i<n_clients;i++)
+				for(int j=0;j<n_clients;j++)
+					if(i!=j && !first_rx[i][j]) connected=0;
+		}
+		for(int i=0;i<n_clients;i++) {
+			stop_process(nats[i].pid);
+			for(int k=0;k<max_mappings;k++)
+				if(nats[i].map[k].sock>=0) map_close(&nats[i].map[k]);
+		}
+		stop_process(server);
+		// time to the first datagram between each pair, in either direction, and in both
+		int run_pairs=0;
+		for(int i=0;i<n_clients;i++)
+			for(int j=i+1;j<n_clients;j++) {
+				int64_t a=first_rx[i][j], b=first_rx[j][i];
+				if(a || b)
+					first_times[n_first++]=(a && (!b || a<b) ? a : b)-start;
+				if(a && b) {
+					both_times[n_both++]=(a>b ? a : b)-start;
+					run_pairs++;
+				}
+			}
+		printf("# run %d: %d/%d pairs reached each other in %.1f s\n", run+1, run_pairs, total, (now-start)/1000.);
+		fflush(stdout);
+	}
+	print_distribution("first datagram", first_times, n_first, run*total);
+	print_distribution("both directions", both_times, n_both, run*total);
+	printf("# datagrams forwarded %" PRIu64 " filtered %" PRIu64 " lost %" PRIu64 ", mappings %" PRIu64 " expired %" PRIu64 "\n", counters.forwarded, counters.filtered, counters.lost, counters.mappings, counters.expired);
+	return(0);
+}
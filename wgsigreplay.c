@@ -0,0 +1,116 @@
+/* wgsigreplay.c - Trace replay for a NAT traversal and endpoint discovery protocol for Wireguard
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2022, Alexandre Janon <alex14fr@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// replay of a trace written by wgsigd -t through the request handling of the server
+//
+// the datagrams received in the same batch are handled in the same batch, with the clock of the server
+// pinned to the time they were received, so that the TAI64N labels of the requests are accepted as they
+// were; responses are built and encrypted, but not sent, and cookies are not required
+
+#include <inttypes.h>
+#include "common.h"
+
+static int64_t mono_ns(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return((int64_t)tp.tv_sec*1000000000+tp.tv_nsec);
+}
+
+int main(int argc, char **argv) {
+	int c, realtime=0, n_verifiers=0;
+	char *whitelist_file=NULL, *next_secret_file=NULL;
+	while((c=getopt(argc, argv, "rw:n:j:"))!=-1) {
+		switch(c) {
+			case 'j': n_verifiers=atoi(optarg); break;
+			case 'r': realtime=1; break;
+			case 'w': whitelist_file=optarg; break;
+			case 'n': next_secret_file=optarg; break;
+			default: argc=0;
+		}
+	}
+	argc-=optind-1;
+	argv+=optind-1;
+	if(argc<3 || n_verifiers<0 || n_verifiers>max_verifiers) {
+		printf("Usage : %s [-r] [-w <whitelist_file>] [-n <next_secret_file>] [-j <verifier_threads>] <trace_file> <secret_file>\nhandles the requests of a trace written by wgsigd -t as fast as possible, or with -r at the pace they were received\n-j decrypts and authenticates the requests in <verifier_threads> threads, as wgsigd -j\n", argv[0]);
+		exit(1);
+	}
+	FILE *f=trace_open(argv[1]);
+	if(!f) {
+		printf("%s is not a wgsigd trace\n", argv[1]);
+		exit(1);
+	}
+	if(!(keys=keyring_load(argv[2], next_secret_file)))
+		exit(6);
+	if(whitelist_file && !(whitelist=whitelist_load(whitelist_file)))
+		exit(6);
+	server_dry_run=1;
+	cookie_policy=cookies_never;
+	if(n_verifiers)
+		pipeline_start(n_verifiers);
+	static struct request rx[rx_batch+1];
+	uint64_t ns, batch_ns=0, first_ns=0;
+	uint64_t datagrams=0, batches=0;
+	int n=0, r;
+	int64_t start=mono_ns();
+	// read ahead the first request of the next batch
+	while((r=trace_read(f, &rx[n], &ns))>0) {
+		if(!first_ns) first_ns=ns;
+		if(n && (ns!=batch_ns || n==rx_batch)) {
+			if(realtime) {
+				int64_t wait=(int64_t)(batch_ns-first_ns)-(mono_ns()-start);
+				struct timespec ts={ wait/1000000000, wait%1000000000 };
+				if(wait>0) nanosleep(&ts, NULL);
+			}
+			pinned_time=batch_ns/1000000000;
+			serve_batch(-1, rx, n);
+			datagrams+=n;
+			batches++;
+			rx[0]=rx[n];
+			n=0;
+		}
+		batch_ns=ns;
+		n++;
+	}
+	if(n) {
+		pinned_time=batch_ns/1000000000;
+		serve_batch(-1, rx, n);
+		datagrams+=n;
+		batches++;
+	}
+	// handle the requests left in the queue of unknown peers
+	while(server_pending())
+		serve_batch(-1, rx, 0);
+	int64_t elapsed=mono_ns()-start;
+	if(r<0)
+		printf("# %s is truncated\n", argv[1]);
+	printf("# %" PRIu64 " datagrams in %" PRIu64 " batches, replayed in %.3f s (%.0f datagrams/s), traced over %.3f s\n", datagrams, batches, elapsed/1e9, (elapsed ? datagrams*1e9/elapsed : 0), (batch_ns-first_ns)/1e9);
+	print_metrics();
+	return(0);
+}
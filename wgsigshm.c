@@ -0,0 +1,77 @@
+/* whitelist.c - Peer ID whitelist for a NAT traversal and endpoint discovery protocol for Wireguard
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2022, Alexandre Janon <alex14fr@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// read-only viewer of the database exported by wgsigd -s
+
+#include "common.h"
+#include <sys/mman.h>
+#include <sched.h>
+
+int main(int argc, char **argv) {
+	if(argc<2) {
+		printf("Usage : %s <shm_name>\nwrites the peers of the database exported by wgsigd -s <shm_name>, with their number of endpoint changes\n", argv[0]);
+		exit(1);
+	}
+	int fd=shm_open(argv[1], O_RDONLY, 0);
+	if(fd<0) {
+		perror(argv[1]);
+		exit(1);
+	}
+	struct shm_db *shm=mmap(NULL, sizeof(struct shm_db), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shm==MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	if(shm->magic!=shm_magic) {
+		printf("%s is not a wgsigd database\n", argv[1]);
+		exit(1);
+	}
+	// take a consistent snapshot: retry while the server updates the database
+	static struct shm_db snap;
+	uint32_t seq;
+	for(;;) {
+		seq=__atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if(seq&1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(&snap, shm, sizeof(struct shm_db));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&shm->seq, __ATOMIC_RELAXED)==seq) break;
+	}
+	if(snap.n_used>max_peers) snap.n_used=max_peers;
+	printf("# %u peers, %llu updates\n", snap.n_used, (unsigned long long)snap.updates);
+	for(int i=0;i<snap.n_used;i++) {
+		printf("%u ", snap.moves[i]);
+		print_record(snap.recs+i*rec_size, NULL, 0, time(NULL));
+	}
+	return(0);
+}
@@ -0,0 +1,126 @@
+/* whitelist.c - Peer ID whitelist for a NAT traversal and endpoint discovery protocol for Wireguard
+ *
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2022, Alexandre Janon <alex14fr@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "common.h"
+#include <stdio.h>
+
+// the whitelist is compiled into a sorted array of Peer IDs, and an array of their first
+// 8 bytes as integers, which is binary-searched before comparing the whole Peer IDs
+
+static int id_cmp(const void *a, const void *b) {
+	return(memcmp(a, b, peer_id_size));
+}
+
+// read a whitelist file of base64-encoded Peer IDs, one per line (empty lines and lines starting with # are ignored)
+// returns the compiled whitelist, or NULL if the file can not be read or holds an invalid Peer ID
+struct whitelist *whitelist_load(char *f) {
+	FILE *fp=fopen(f, "r");
+	if(!fp) {
+		perror(f);
+		return(NULL);
+	}
+	struct whitelist *wl=calloc(1, sizeof(struct whitelist));
+	int alloc=0, line=0;
+	char buf[256];
+	while(wl && fgets(buf, sizeof(buf), fp)) {
+		line++;
+		char *p=buf, *e=buf+strlen(buf);
+		while(*p==' ' || *p=='\t') p++;
+		while(e>p && (e[-1]=='\n' || e[-1]=='\r' || e[-1]==' ' || e[-1]=='\t')) e--;
+		*e=0;
+		if(!*p || *p=='#') continue;
+		unsigned char id[peer_id_size];
+		// reject anything that is not the canonical encoding of 32 bytes
+		if(e-p!=44 || base64_decode_keys((unsigned char*)p, 44, 1, id)!=1) {
+			printf("%s:%d: invalid peer ID\n", f, line);
+			whitelist_free(wl);
+			wl=NULL;
+			break;
+		}
+		if(wl->n==alloc) {
+			alloc=(alloc ? 2*alloc : 64);
+			unsigned char *ids=realloc(wl->ids, alloc*peer_id_size);
+			if(!ids) {
+				whitelist_free(wl);
+				wl=NULL;
+				break;
+			}
+			wl->ids=ids;
+		}
+		memcpy(wl->ids+(wl->n++)*peer_id_size, id, peer_id_size);
+	}
+	fclose(fp);
+	if(!wl) return(NULL);
+	// sort, remove duplicates and extract the search keys
+	qsort(wl->ids, wl->n, peer_id_size, id_cmp);
+	int n=0;
+	for(int i=0;i<wl->n;i++)
+		if(!n || memcmp(wl->ids+(n-1)*peer_id_size, wl->ids+i*peer_id_size, peer_id_size))
+			memmove(wl->ids+(n++)*peer_id_size, wl->ids+i*peer_id_size, peer_id_size);
+	wl->n=n;
+	wl->keys=malloc((n ? n : 1)*sizeof(uint64_t));
+	if(!wl->keys) {
+		whitelist_free(wl);
+		return(NULL);
+	}
+	for(int i=0;i<n;i++) {
+		memcpy(&wl->keys[i], wl->ids+i*peer_id_size, 8);
+		wl->keys[i]=be64toh(wl->keys[i]);
+	}
+	return(wl);
+}
+
+void whitelist_free(struct whitelist *wl) {
+	if(!wl) return;
+	free(wl->ids);
+	free(wl->keys);
+	free(wl);
+}
+
+// returns 1 if peer_id is in the whitelist, 0 otherwise
+int whitelist_search(struct whitelist *wl, unsigned char *peer_id) {
+	uint64_t key;
+	memcpy(&key, peer_id, 8);
+	key=be64toh(key);
+	// branchless lower bound of key in wl->keys
+	uint64_t *base=wl->keys;
+	int n=wl->n;
+	if(!n) return(0);
+	while(n>1) {
+		int half=n/2;
+		base=(base[half]<key ? base+half : base);
+		n-=half;
+	}
+	if(*base<key) base++;
+	for(int i=base-wl->keys; i<wl->n && wl->keys[i]==key; i++)
+		if(!memcmp(wl->ids+i*peer_id_size, peer_id, peer_id_size))
+			return(1);
+	return(0);
+}